@@ -6,10 +6,13 @@
 namespace NNActivation {
 	// Sigmoid activation function
 	// σ(x) = 1 / (1 + e^-x)
+	inline void sigmoidInPlace(NNMatrix& m) {
+		for (std::vector<double>& row : m.data) {
+			for (double& x : row) x = 1.0 / (1.0 + std::exp(-x));
+		}
+	}
 	inline NNMatrix sigmoid(NNMatrix input) {
-		input.forEach([](double* x, int, int) {
-			*x = 1.0 / (1.0 + std::exp(-*x));
-		});
+		sigmoidInPlace(input);
 		return input;
 	}
 	// Derivative of sigmoid activation function
@@ -17,12 +20,23 @@ namespace NNActivation {
 	inline NNMatrix sigmoidDerivative(NNMatrix output) {
 		return output * (1.0 - output);
 	}
+	// Error of the input from the output and its error without allocating
+	// dx = dy * y * (1 - y)
+	inline void sigmoidBackward(const NNMatrix& output, const NNMatrix& dy, NNMatrix& dx) {
+		dx.resize(output.rows(), output.cols());
+		for (int i = 0; i < output.rows(); i++) {
+			for (int j = 0; j < output.cols(); j++) dx[i][j] = dy[i][j] * output[i][j] * (1.0 - output[i][j]);
+		}
+	}
 	// ReLU activation function
 	// ReLU(x) = max(0, x)
+	inline void reluInPlace(NNMatrix& m) {
+		for (std::vector<double>& row : m.data) {
+			for (double& x : row) x = std::max(0.0, x);
+		}
+	}
 	inline NNMatrix relu(NNMatrix input) {
-		input.forEach([](double* x, int, int) {
-			*x = std::max(0.0, *x);
-		});
+		reluInPlace(input);
 		return input;
 	}
 	// Derivative of ReLU activation function
@@ -33,12 +47,23 @@ namespace NNActivation {
 		});
 		return output;
 	}
+	// Error of the input from the output and its error without allocating
+	// dx = dy if y > 0 else 0
+	inline void reluBackward(const NNMatrix& output, const NNMatrix& dy, NNMatrix& dx) {
+		dx.resize(output.rows(), output.cols());
+		for (int i = 0; i < output.rows(); i++) {
+			for (int j = 0; j < output.cols(); j++) dx[i][j] = output[i][j] > 0.0 ? dy[i][j] : 0.0;
+		}
+	}
 	// Hyperbolic tangent activation function
 	// tanh(x) = (e^x-e^-x)/(e^x+e^-x)
+	inline void tanhInPlace(NNMatrix& m) {
+		for (std::vector<double>& row : m.data) {
+			for (double& x : row) x = std::tanh(x);
+		}
+	}
 	inline NNMatrix tanh(NNMatrix input) {
-		input.forEach([](double* x, int, int) {
-			*x = std::tanh(*x);
-		});
+		tanhInPlace(input);
 		return input;
 	}
 	// Derivative of hyperbolic tangent activation function
@@ -47,25 +72,54 @@ namespace NNActivation {
 	inline NNMatrix tanhDerivative(NNMatrix output) {
 		return 1 - (output ^ 2);
 	}
+	// Error of the input from the output and its error without allocating
+	// dx = dy * (1 - y^2)
+	inline void tanhBackward(const NNMatrix& output, const NNMatrix& dy, NNMatrix& dx) {
+		dx.resize(output.rows(), output.cols());
+		for (int i = 0; i < output.rows(); i++) {
+			for (int j = 0; j < output.cols(); j++) dx[i][j] = dy[i][j] * (1.0 - output[i][j] * output[i][j]);
+		}
+	}
 	// Softmax activation function
 	// softmax(X)_i = e^(X_i) / sum_j=1^N e^(X_j)
+	// Each column is treated as a separate sample
+	inline void softmaxInPlace(NNMatrix& input) {
+		for (int j = 0; j < input.cols(); j++) {
+			double max = input[0][j];
+			for (int i = 1; i < input.rows(); i++) max = std::max(max, input[i][j]);
+			double sum = 0;
+			for (int i = 0; i < input.rows(); i++) {
+				input[i][j] = std::exp(input[i][j] - max); // Subtract max for numerical stability while maintaining output
+				sum += input[i][j];
+			}
+			for (int i = 0; i < input.rows(); i++) input[i][j] /= sum;
+		}
+	}
 	inline NNMatrix softmax(NNMatrix input) {
-		double sum = 0;
-		double max = input.max();
-		input.forEach([&sum, max, &input](double* x, int, int) {
-			*x = std::exp(*x - max); // Subtract max for numerical stability while maintaining output
-			sum += *x;
-		});
-		return input / sum;
+		softmaxInPlace(input);
+		return input;
 	}
 	// Derivative of softmax activation function
 	// This derivative is special as it directly gives the p.d. of the loss w.r.t. the input
 	// This derivative is a simplification of the actual derivative which is a Jacobian matrix
 	// Let y_i = softmax(X)_i and dy be the p.d. of the loss w.r.t. to y
-	// softmax'(X) = y(dy - s) where s = y^T . dy
+	// softmax'(X) = y(dy - s) where s = y^T . dy (per column)
 	inline NNMatrix softmaxDerivative(NNMatrix output, NNMatrix dy) {
-		double s = NNMatrix::dot(output.transpose(), dy)[0][0];
-		return output * (dy - s);
+		for (int j = 0; j < output.cols(); j++) {
+			double s = 0;
+			for (int i = 0; i < output.rows(); i++) s += output[i][j] * dy[i][j];
+			for (int i = 0; i < output.rows(); i++) output[i][j] *= dy[i][j] - s;
+		}
+		return output;
+	}
+	// Error of the input from the output and its error without allocating
+	inline void softmaxBackward(const NNMatrix& output, const NNMatrix& dy, NNMatrix& dx) {
+		dx.resize(output.rows(), output.cols());
+		for (int j = 0; j < output.cols(); j++) {
+			double s = 0;
+			for (int i = 0; i < output.rows(); i++) s += output[i][j] * dy[i][j];
+			for (int i = 0; i < output.rows(); i++) dx[i][j] = output[i][j] * (dy[i][j] - s);
+		}
 	}
 }
 
@@ -0,0 +1,657 @@
+#ifndef DISTRIBUTED_HPP
+#define DISTRIBUTED_HPP
+
+#include "./neural-network.hpp"
+#include <cstring>
+#include <cstdio>
+#include <new>
+#include <mutex>
+#include <condition_variable>
+#include <ostream>
+#include <cstdint>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Data-parallel training across local processes (POSIX only, so neural-network.hpp does not include this header)
+// NNProcessGroup::launch() forks worker processes that share a memory region with the launching process
+// Every process holds its own replica of the network and the averaged gradients are summed after each sample with a
+// ring all-reduce through the shared memory, so processes do not share an allocator or threads
+
+enum class NNCompressionType { None, TopK, Int8, Sign };
+
+class NNProcessGroup {
+public:
+	int rank = 0, size = 1;
+	// Overlap the gradient all-reduce with backward propagation of the trainers attached afterwards (Default true)
+	// The gradients are grouped into buckets of at least `bucketSize` values in reverse layer order (see planBuckets()), and a
+	// communication thread reduces each bucket as soon as backward propagation finished its layers (see NeuralNetwork::gradsReady)
+	// Smaller buckets start reducing earlier and larger buckets need fewer synchronizations
+	bool overlap = true;
+	size_t bucketSize = 1 << 16;
+	// Shard the optimizer state of the trainers attached afterwards (ZeRO-style, Default false)
+	// Every process keeps the momentum and adam moments of only its share of the rows of every parameter and updates only those
+	// rows, then the updated rows are gathered into every process, so optimizer memory and update work shrink by the group size
+	// Call gatherOptimizerState() on every process before saving the training state (e.g. in an epoch callback)
+	bool shardOptimizerState = false;
+	// Optional compression of the gradient values exchanged by the all-reduce (Default none)
+	// TopK sends the `topK` fraction of the values with the largest magnitudes with their indices, Int8 sends every value in 8 bits
+	// and Sign in 1 bit, both with a scale per block of 256 values
+	// Every process keeps what its messages did not carry and adds it to its next gradients (error feedback), so dropped and
+	// rounded parts are delayed instead of lost
+	// Compressed messages are gathered from every process and summed in rank order (Row flags of sparse gradients are not compressed)
+	// Since every process receives size - 1 messages, compression only saves traffic while a message is smaller than 2 / size of the
+	// values (Int8 below 16 processes, Sign below about 100 and TopK below about 1.3 / topK), otherwise the plain ring is used
+	NNCompressionType compression = NNCompressionType::None;
+	double topK = 0.01;
+	// Record the computation of every iteration and the reduction of every bucket in `timeline` (Default false)
+	bool recordTimeline = false;
+	// Interval in seconds since launch() of the computation (bucket -1) or of the reduction of a bucket in an iteration
+	struct Interval {
+		int iteration, bucket;
+		double start, end;
+	};
+	std::vector<Interval> timeline;
+	// Layer ranges [first, second] of the buckets in reduction order (see planBuckets())
+	std::vector<std::pair<int, int>> buckets;
+
+	// Run fn(group) on `size` processes with ranks 0 to size - 1 (The calling process is rank 0 and the others are forked)
+	// Everything set up before launching (networks, datasets) is copied into every process
+	// When a process throws or exits unexpectedly, the others stop at their next synchronization and launch() throws on rank 0
+	// `slot` is the number of doubles a process exchanges per ring step (The shared memory holds 2 * size slots)
+	static void launch(int size, std::function<void(NNProcessGroup&)> fn, size_t slot = 1 << 16) {
+		if (size < 1) throw std::runtime_error("A process group needs at least one process");
+		if (slot == 0) throw std::runtime_error("Process group slots cannot be empty");
+		NNProcessGroup group;
+		group.size = size;
+		group.slot = slot;
+		group.bytes = sizeof(Header) + 2 * size * slot * sizeof(double);
+		void* memory = mmap(nullptr, group.bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED) throw std::runtime_error("Cannot map shared memory for the process group");
+		group.header = new (memory) Header();
+		group.header->seed = std::random_device()() | 1u; // Never 0, which means a time based seed for NNTrainer
+		group.slots = reinterpret_cast<double*>(group.header + 1);
+		group.parent = getpid();
+		group.started = std::chrono::steady_clock::now();
+		// Buffered output would otherwise be written by every process
+		std::cout.flush();
+		std::fflush(nullptr);
+		for (int r = 1; r < size; r++) {
+			pid_t pid = fork();
+			if (pid < 0) {
+				group.fail("Cannot fork rank " + std::to_string(r));
+				break;
+			}
+			if (pid == 0) {
+				group.rank = r;
+				group.children.clear();
+				int status = 0;
+				try {
+					fn(group);
+				} catch (const std::exception& e) {
+					group.fail(e.what());
+					status = 1;
+				} catch (...) {
+					group.fail("Unknown exception");
+					status = 1;
+				}
+				group.stop();
+				std::cout.flush();
+				std::fflush(nullptr);
+				_exit(status); // Skip the destructors and exit handlers of the copied launching process
+			}
+			group.children.push_back(pid);
+			group.statuses.push_back(-1);
+		}
+		std::exception_ptr error;
+		if (group.header->failedRank < 0) {
+			try {
+				fn(group);
+			} catch (const std::exception& e) {
+				group.fail(e.what());
+				error = std::current_exception();
+			} catch (...) {
+				group.fail("Unknown exception");
+				error = std::current_exception();
+			}
+		}
+		group.stop();
+		// Wait for every worker, stopping them if the launching process failed before they finished
+		for (int k = 0; k < group.children.size(); k++) {
+			if (group.statuses[k] != -1) continue;
+			if (group.header->failedRank >= 0 && waitpid(group.children[k], &group.statuses[k], WNOHANG) == 0) kill(group.children[k], SIGTERM);
+			if (group.statuses[k] == -1) waitpid(group.children[k], &group.statuses[k], 0);
+		}
+		std::string message;
+		int failed = group.header->failedRank;
+		if (failed >= 0) message = "Rank " + std::to_string(failed) + " failed: " + group.header->message;
+		for (int k = 0; failed < 0 && k < group.children.size(); k++) {
+			int status = group.statuses[k];
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) message = "Rank " + std::to_string(k + 1) + " exited unexpectedly";
+		}
+		munmap(memory, group.bytes);
+		if (error && failed == 0) std::rethrow_exception(error);
+		if (!message.empty()) throw std::runtime_error(message);
+	}
+
+	// Set up a trainer to train on the share of this process of every sample and to all-reduce the gradients
+	// With `overlap`, the buckets are planned for the current layers of the network, which should not change while training
+	void attach(NNTrainer& trainer) {
+		trainer.rank = rank;
+		trainer.worldSize = size;
+		trainer.shuffleSeed = header->seed;
+		trainer.gatherParams = nullptr;
+		if (shardOptimizerState && size > 1) trainer.gatherParams = [this](NeuralNetwork& nn) { gatherParams(nn); };
+		if (!overlap || size == 1) {
+			trainer.allReduce = [this](NeuralNetwork& nn, int local, int total) { allReduce(nn, local, total); };
+			return;
+		}
+		stop();
+		network = &trainer.nn;
+		planBuckets(*network);
+		network->gradsReady = [this](int i, int points) { layerReady(i, points); };
+		trainer.allReduce = [this](NeuralNetwork& nn, int local, int) { finishBuckets(nn, local); };
+		stopping = false;
+		computeStart = now();
+		worker = std::thread([this]() { reduceBuckets(); });
+	}
+	// Group the layers of a network into buckets of at least `bucketSize` gradient values, starting from the last layer
+	// A bucket is reduced once its first layer is finished, so the last bucket also takes the remaining layers
+	void planBuckets(NeuralNetwork& nn) {
+		buckets.clear();
+		size_t values = 0;
+		for (int i = nn.depth - 1, last = i; i >= 0; i--) {
+			values += gradValues(nn, i);
+			if (values >= bucketSize || i == 0) {
+				buckets.emplace_back(i, last);
+				values = 0;
+				last = i - 1;
+			}
+		}
+		plannedDepth = nn.depth;
+	}
+	// Fraction of the reduction time hidden behind the computation in the timeline (1 when all reductions overlapped)
+	double overlapEfficiency() const {
+		std::vector<std::pair<double, double>> compute;
+		for (const Interval& interval : timeline) {
+			if (interval.bucket != -1) continue;
+			if (compute.size() <= interval.iteration) compute.resize(interval.iteration + 1);
+			compute[interval.iteration] = { interval.start, interval.end };
+		}
+		double hidden = 0, total = 0;
+		for (const Interval& interval : timeline) {
+			if (interval.bucket == -1 || interval.iteration >= compute.size()) continue;
+			total += interval.end - interval.start;
+			const std::pair<double, double>& window = compute[interval.iteration];
+			hidden += std::max(0.0, std::min(interval.end, window.second) - std::max(interval.start, window.first));
+		}
+		return total == 0 ? 0 : hidden / total;
+	}
+	// Doubles the plain ring all-reduce would have sent per process for the gradient values so far over the doubles actually sent
+	// (1 without compression)
+	double compressionRatio() const { return sentValues == 0 ? 1 : rawValues / sentValues; }
+	// Write the timeline as lines of "iteration bucket start end" with times in milliseconds (bucket -1 is the computation)
+	void writeTimeline(std::ostream& out) const {
+		for (const Interval& interval : timeline) {
+			out << interval.iteration << ' ' << interval.bucket << ' ' << interval.start * 1000 << ' ' << interval.end * 1000 << '\n';
+		}
+	}
+	// Replace the averaged gradients of `local` data points on every process with their average over the `total` data points
+	// All processes end with bit-identical gradients (Every value is summed once and then copied)
+	// Rows of sparse gradients are merged, so the rows set on any process are set on all of them
+	void allReduce(NeuralNetwork& nn, int local, int total) {
+		flat.clear();
+		exact.clear();
+		packGrads(nn, 0, nn.depth - 1, local, flat, exact);
+		reduceGrads(flat, exact, 0);
+		unpackGrads(nn, 0, nn.depth - 1, total, flat.data(), exact.data());
+		averageRunningStats(nn, local);
+	}
+	// Replace the running statistics of every BatchNormLayer with their average over the processes, weighted by the `local` data
+	// points each process propagated, so the replicas keep identical running statistics
+	// With packed samples, each process still normalizes with the batch statistics of its own share, so the averaged running mean
+	// equals that of the whole sample, and the running variance averages the variances of the shares
+	void averageRunningStats(NeuralNetwork& nn, int local) {
+		std::vector<NNMatrix*> stats;
+		for (int i = 0; i < nn.depth; i++) {
+			BatchNormLayer* norm = dynamic_cast<BatchNormLayer*>(nn.layers[i].get());
+			if (norm) stats.insert(stats.end(), { &norm->runningMean, &norm->runningVar });
+		}
+		if (stats.empty()) return;
+		std::vector<double> values;
+		for (NNMatrix* stat : stats) {
+			for (int r = 0; r < stat->rows(); r++) values.push_back((*stat)[r][0] * local);
+		}
+		values.push_back(local);
+		ringAllReduce(values);
+		double total = values.back();
+		if (total == 0) return;
+		const double* value = values.data();
+		for (NNMatrix* stat : stats) {
+			for (int r = 0; r < stat->rows(); r++) (*stat)[r][0] = *value++ / total;
+		}
+	}
+	// Copy the parameter rows updated by every process into all processes (see NNTrainer::gatherParams)
+	void gatherParams(NeuralNetwork& nn) {
+		std::vector<NNMatrix*> params;
+		for (int i = 0; i < nn.depth; i++) {
+			for (int j = 0; j < nn.layers[i]->params.size(); j++) params.push_back(&nn.layers[i]->params[j].get());
+		}
+		gatherRows(nn, params);
+	}
+	// Complete the sharded optimizer moments on every process, so the training state can be saved or trained without sharding
+	// Training with a sharded optimizer state shards the complete moments again
+	void gatherOptimizerState(NeuralNetwork& nn) {
+		for (std::vector<std::vector<NNMatrix>>* moment : { &nn.momentumV, &nn.adamM, &nn.adamV }) {
+			std::vector<NNMatrix*> states;
+			for (int i = 0; i < nn.depth; i++) {
+				for (NNMatrix& state : (*moment)[i]) states.push_back(&state);
+			}
+			gatherRows(nn, states);
+		}
+	}
+	// Pass the share [offsets[r], offsets[r + 1]) of `data` of every process r to all processes with a ring all-gather
+	void ringAllGather(std::vector<double>& data, const std::vector<size_t>& offsets) {
+		if (size == 1) return;
+		int previous = (rank - 1 + size) % size;
+		size_t longest = 0;
+		for (int k = 0; k < size; k++) longest = std::max(longest, offsets[k + 1] - offsets[k]);
+		// Shares are passed around the ring in slot-sized pieces
+		for (size_t piece = 0; piece < longest; piece += slot) {
+			auto begin = [&offsets, piece](int k) { return offsets[k] + std::min(piece, offsets[k + 1] - offsets[k]); };
+			auto end = [this, &offsets, piece](int k) { return offsets[k] + std::min(piece + slot, offsets[k + 1] - offsets[k]); };
+			for (int t = 0; t < size - 1; t++) {
+				int send = (rank - t + size) % size, receive = (rank - t - 1 + size) % size;
+				std::copy(data.begin() + begin(send), data.begin() + end(send), slotOf(rank));
+				barrier();
+				std::copy(slotOf(previous), slotOf(previous) + (end(receive) - begin(receive)), data.begin() + begin(receive));
+				step++;
+			}
+		}
+	}
+	// Sum a vector over all processes in place with a ring all-reduce through the shared memory
+	// Each slot-sized chunk is reduced along the ring (reduce-scatter) and the results are passed around again (all-gather)
+	void ringAllReduce(std::vector<double>& data) {
+		if (size == 1) return;
+		int previous = (rank - 1 + size) % size;
+		for (size_t offset = 0; offset < data.size(); offset += size * slot) {
+			size_t length = std::min(size * slot, data.size() - offset);
+			size_t chunk = (length + size - 1) / size;
+			auto begin = [offset, length, chunk](int k) { return offset + std::min(length, k * chunk); };
+			// Reduce-scatter: after size - 1 steps this process holds the sum of chunk rank + 1
+			for (int t = 0; t < size - 1; t++) {
+				int send = (rank - t + size) % size, receive = (rank - t - 1 + size) % size;
+				std::copy(data.begin() + begin(send), data.begin() + begin(send + 1), slotOf(rank));
+				barrier();
+				const double* in = slotOf(previous);
+				for (size_t p = begin(receive); p < begin(receive + 1); p++) data[p] += *in++;
+				step++;
+			}
+			// All-gather: pass the summed chunks around the ring
+			for (int t = 0; t < size - 1; t++) {
+				int send = (rank + 1 - t + size) % size, receive = (rank - t + size) % size;
+				std::copy(data.begin() + begin(send), data.begin() + begin(send + 1), slotOf(rank));
+				barrier();
+				std::copy(slotOf(previous), slotOf(previous) + (begin(receive + 1) - begin(receive)), data.begin() + begin(receive));
+				step++;
+			}
+		}
+	}
+	// Wait until every process reaches the barrier (Throws when another process failed)
+	void barrier() {
+		int generation = header->generation.load();
+		if (header->arrived.fetch_add(1) == size - 1) {
+			header->arrived = 0;
+			header->generation++;
+			return;
+		}
+		while (header->generation.load() == generation) {
+			checkPeers(generation);
+			std::this_thread::yield();
+		}
+	}
+	// Report a failure of this process to the others (Only the first failure is kept)
+	void fail(const std::string& message) {
+		int expected = 0;
+		if (!header->claimed.compare_exchange_strong(expected, 1)) return;
+		std::strncpy(header->message, message.c_str(), sizeof(header->message) - 1);
+		header->failedRank = rank;
+	}
+private:
+	// Aligned so the slots after it are aligned as well
+	struct alignas(64) Header {
+		std::atomic<int> arrived{0}, generation{0};
+		std::atomic<int> claimed{0}, failedRank{-1};
+		char message[256] = {};
+		unsigned int seed = 0;
+	};
+	Header* header = nullptr;
+	double* slots = nullptr;
+	size_t slot = 0, bytes = 0;
+	long long step = 0; // Consecutive ring steps alternate between two sets of slots
+	pid_t parent = 0;
+	std::vector<pid_t> children;
+	std::vector<int> statuses; // -1 while a worker is running
+	std::vector<double> flat, exact;
+	// Compression: error feedback residuals by reduction (0 without overlap or the bucket index), scratch buffers and sizes in doubles
+	std::vector<std::vector<double>> residuals;
+	std::vector<double> gathered;
+	std::vector<uint32_t> order;
+	double rawValues = 0, sentValues = 0;
+	static constexpr size_t block = 256;
+	std::chrono::steady_clock::time_point started;
+	// Overlapped reduction: the communication thread reduces buckets [reduced, launched) of the current iteration
+	NeuralNetwork* network = nullptr;
+	int plannedDepth = 0, launched = 0, reduced = 0, iteration = 0, points = 0;
+	bool stopping = false;
+	double computeStart = 0;
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::exception_ptr workerError;
+	std::vector<double> bucketFlat, bucketExact; // Only used by the communication thread
+
+	double now() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count(); }
+	// Number of values layer i adds to the reduced vector (Gradients and the row flags of sparse gradients)
+	static size_t gradValues(NeuralNetwork& nn, int i) {
+		size_t values = 0;
+		for (const NNMatrix& grad : nn.avgGrads[i]) {
+			values += static_cast<size_t>(grad.rows()) * grad.cols();
+			if (nn.layers[i]->sparseGrads) values += grad.rows();
+		}
+		return values;
+	}
+	// Append the averaged gradients of layers [first, last] times `scale` to `values` and the row flags of sparse gradients to `flags`
+	static void packGrads(NeuralNetwork& nn, int first, int last, double scale, std::vector<double>& values, std::vector<double>& flags) {
+		for (int i = first; i <= last; i++) {
+			for (int j = 0; j < nn.avgGrads[i].size(); j++) {
+				const NNMatrix& grad = nn.avgGrads[i][j];
+				for (const std::vector<double>& row : grad.data) {
+					for (double val : row) values.push_back(val * scale);
+				}
+				if (!nn.layers[i]->sparseGrads) continue;
+				size_t begin = flags.size();
+				flags.resize(begin + grad.rows(), 0.0);
+				for (int r : nn.avgRows[i][j]) flags[begin + r] = 1;
+			}
+		}
+	}
+	// Set the averaged gradients of layers [first, last] to the summed values divided by `total` (Inverse of packGrads())
+	static void unpackGrads(NeuralNetwork& nn, int first, int last, double total, const double* values, const double* flags) {
+		for (int i = first; i <= last; i++) {
+			for (int j = 0; j < nn.avgGrads[i].size(); j++) {
+				NNMatrix& grad = nn.avgGrads[i][j];
+				for (std::vector<double>& row : grad.data) {
+					for (double& val : row) val = *values++ / total;
+				}
+				if (!nn.layers[i]->sparseGrads) continue;
+				std::vector<int>& rows = nn.avgRows[i][j];
+				rows.clear();
+				for (int r = 0; r < grad.rows(); r++) {
+					if (flags[r] > 0) rows.push_back(r);
+				}
+				flags += grad.rows();
+			}
+		}
+	}
+	// Sum gradient values and exact values (row flags and data point counts) over all processes, compressing the gradient values
+	// `key` selects the error feedback residual of the reduction
+	void reduceGrads(std::vector<double>& values, std::vector<double>& exacts, int key) {
+		size_t count = values.size();
+		if (compression != NNCompressionType::None) {
+			if (residuals.size() <= key) residuals.resize(key + 1);
+			std::vector<double>& residual = residuals[key];
+			if (residual.size() != count) residual.assign(count, 0.0);
+			for (size_t p = 0; p < count; p++) values[p] += residual[p];
+			std::fill(residual.begin(), residual.end(), 0.0);
+		}
+		// Every process receives the messages of the other processes, while the plain ring sends 2 (size - 1) / size times the values
+		size_t length = messageLength(count);
+		double plain = 2.0 * (size - 1) / size * count;
+		if (compression == NNCompressionType::None || length * size >= 2 * count) {
+			values.insert(values.end(), exacts.begin(), exacts.end());
+			ringAllReduce(values);
+			std::copy(values.begin() + count, values.end(), exacts.begin());
+			values.resize(count);
+			if (compression == NNCompressionType::None) return;
+			rawValues += plain;
+			sentValues += plain;
+			return;
+		}
+		ringAllReduce(exacts);
+		std::vector<double>& residual = residuals[key];
+		gathered.assign(size * length, 0.0);
+		double* message = gathered.data() + rank * length;
+		encode(values, message);
+		// The residual is the part of the values that the message does not carry
+		residual = values;
+		decode(message, residual, -1);
+		std::vector<size_t> offsets(size + 1);
+		for (int k = 0; k <= size; k++) offsets[k] = k * length;
+		ringAllGather(gathered, offsets);
+		std::fill(values.begin(), values.end(), 0.0);
+		for (int k = 0; k < size; k++) decode(gathered.data() + k * length, values, 1);
+		rawValues += plain;
+		sentValues += static_cast<double>(size - 1) * length;
+	}
+	// Number of doubles of the message of `count` gradient values
+	size_t messageLength(size_t count) const {
+		size_t blocks = (count + block - 1) / block;
+		switch (compression) {
+			case NNCompressionType::TopK: {
+				size_t k = topKCount(count);
+				return k + (k + 1) / 2; // Values and 32 bit indices
+			}
+			case NNCompressionType::Int8: return blocks + (count + 7) / 8;
+			case NNCompressionType::Sign: return blocks + (count + 63) / 64;
+			default: return count;
+		}
+	}
+	size_t topKCount(size_t count) const {
+		if (count == 0) return 0;
+		return std::min(count, std::max(static_cast<size_t>(1), static_cast<size_t>(std::ceil(topK * count))));
+	}
+	// Write the compressed message of `values`
+	void encode(const std::vector<double>& values, double* message) {
+		size_t count = values.size(), blocks = (count + block - 1) / block;
+		if (compression == NNCompressionType::TopK) {
+			size_t k = topKCount(count);
+			if (k == 0) return;
+			order.resize(count);
+			for (size_t p = 0; p < count; p++) order[p] = p;
+			std::nth_element(order.begin(), order.begin() + k - 1, order.end(), [&values](uint32_t a, uint32_t b) {
+				return std::abs(values[a]) > std::abs(values[b]);
+			});
+			for (size_t p = 0; p < k; p++) message[p] = values[order[p]];
+			std::memcpy(message + k, order.data(), k * sizeof(uint32_t));
+			return;
+		}
+		for (size_t b = 0; b < blocks; b++) {
+			size_t begin = b * block, end = std::min(count, begin + block);
+			double scale = 0;
+			for (size_t p = begin; p < end; p++) {
+				if (compression == NNCompressionType::Int8) scale = std::max(scale, std::abs(values[p]) / 127);
+				else scale += std::abs(values[p]) / (end - begin);
+			}
+			message[b] = scale;
+			if (compression == NNCompressionType::Int8) {
+				signed char* bytes = reinterpret_cast<signed char*>(message + blocks);
+				for (size_t p = begin; p < end; p++) bytes[p] = scale == 0 ? 0 : static_cast<signed char>(std::lround(values[p] / scale));
+				continue;
+			}
+			unsigned char* bits = reinterpret_cast<unsigned char*>(message + blocks);
+			for (size_t p = begin; p < end; p++) {
+				if (values[p] >= 0) bits[p / 8] |= 1 << (p % 8);
+			}
+		}
+	}
+	// Add `factor` times the values of a compressed message to `out`
+	void decode(const double* message, std::vector<double>& out, double factor) const {
+		size_t count = out.size(), blocks = (count + block - 1) / block;
+		if (compression == NNCompressionType::TopK) {
+			size_t k = topKCount(count);
+			const unsigned char* indices = reinterpret_cast<const unsigned char*>(message + k);
+			for (size_t p = 0; p < k; p++) {
+				uint32_t index;
+				std::memcpy(&index, indices + p * sizeof(uint32_t), sizeof(uint32_t));
+				out[index] += factor * message[p];
+			}
+			return;
+		}
+		const signed char* bytes = reinterpret_cast<const signed char*>(message + blocks);
+		const unsigned char* bits = reinterpret_cast<const unsigned char*>(message + blocks);
+		for (size_t p = 0; p < count; p++) {
+			double scale = message[p / block];
+			if (compression == NNCompressionType::Int8) out[p] += factor * bytes[p] * scale;
+			else out[p] += factor * ((bits[p / 8] >> (p % 8)) & 1 ? scale : -scale);
+		}
+	}
+	// All-gather matrices shaped like the parameters of a network (in order) whose rows are split into the shares of the processes
+	// (see NNTrainer::shardBegin()) and that hold either all rows or only the share of this process, so they end with all rows
+	void gatherRows(NeuralNetwork& nn, const std::vector<NNMatrix*>& matrices) {
+		std::vector<std::pair<int, int>> shapes;
+		for (int i = 0; i < nn.depth; i++) {
+			for (int j = 0; j < nn.layers[i]->params.size(); j++) {
+				const NNMatrix& param = nn.layers[i]->params[j].get();
+				shapes.emplace_back(param.rows(), param.cols());
+			}
+		}
+		// The shares of a process are stored consecutively
+		std::vector<size_t> offsets(size + 1, 0);
+		for (int k = 0; k < size; k++) {
+			offsets[k + 1] = offsets[k];
+			for (const std::pair<int, int>& shape : shapes) {
+				int rows = NNTrainer::shardBegin(shape.first, k + 1, size) - NNTrainer::shardBegin(shape.first, k, size);
+				offsets[k + 1] += static_cast<size_t>(rows) * shape.second;
+			}
+		}
+		flat.assign(offsets[size], 0.0);
+		size_t p = offsets[rank];
+		for (int m = 0; m < matrices.size(); m++) {
+			const NNMatrix& matrix = *matrices[m];
+			int rows = shapes[m].first, first = NNTrainer::shardBegin(rows, rank, size), last = NNTrainer::shardBegin(rows, rank + 1, size);
+			int skip = matrix.rows() == rows ? first : 0;
+			for (int r = first; r < last; r++) {
+				std::copy(matrix[r - first + skip].begin(), matrix[r - first + skip].end(), flat.begin() + p);
+				p += shapes[m].second;
+			}
+		}
+		ringAllGather(flat, offsets);
+		for (int m = 0; m < matrices.size(); m++) {
+			if (matrices[m]->rows() != shapes[m].first) matrices[m]->resize(shapes[m].first, shapes[m].second);
+		}
+		for (int k = 0; k < size; k++) {
+			p = offsets[k];
+			for (int m = 0; m < matrices.size(); m++) {
+				NNMatrix& matrix = *matrices[m];
+				int cols = shapes[m].second;
+				for (int r = NNTrainer::shardBegin(shapes[m].first, k, size); r < NNTrainer::shardBegin(shapes[m].first, k + 1, size); r++) {
+					std::copy(flat.begin() + p, flat.begin() + p + cols, matrix[r].begin());
+					p += cols;
+				}
+			}
+		}
+	}
+	// Called by the network with every finished layer in reverse order: launch the bucket once its first layer is finished
+	void layerReady(int i, int count) {
+		std::lock_guard<std::mutex> lock(mutex);
+		points = count;
+		if (launched < buckets.size() && buckets[launched].first == i) {
+			launched++;
+			changed.notify_all();
+		}
+	}
+	// Called by the trainer after the averaged gradients: reduce the buckets that were not launched (e.g. when this process had
+	// no data points) and wait for all of them
+	void finishBuckets(NeuralNetwork& nn, int local) {
+		if (&nn != network || nn.depth != plannedDepth) throw std::runtime_error("The network changed after attaching it to the process group");
+		double computeEnd = now();
+		std::unique_lock<std::mutex> lock(mutex);
+		points = local;
+		launched = buckets.size();
+		changed.notify_all();
+		changed.wait(lock, [this]() { return reduced == buckets.size() || workerError; });
+		launched = reduced = 0;
+		// The communication thread waits for the next iteration, so the running statistics can use the ring
+		if (!workerError) averageRunningStats(nn, local);
+		if (recordTimeline) timeline.push_back({ iteration, -1, computeStart, computeEnd });
+		iteration++;
+		computeStart = now();
+		if (workerError) std::rethrow_exception(workerError);
+	}
+	// Loop of the communication thread
+	// Every bucket carries the number of data points of the process, so their sum divides the summed gradients
+	void reduceBuckets() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			changed.wait(lock, [this]() { return stopping || reduced < launched; });
+			if (stopping) return;
+			int b = reduced, first = buckets[b].first, last = buckets[b].second;
+			double weight = points, start = now();
+			lock.unlock();
+			try {
+				bucketFlat.clear();
+				bucketExact.clear();
+				packGrads(*network, first, last, weight, bucketFlat, bucketExact);
+				bucketExact.push_back(weight);
+				reduceGrads(bucketFlat, bucketExact, b);
+				unpackGrads(*network, first, last, bucketExact.back(), bucketFlat.data(), bucketExact.data());
+			} catch (...) {
+				lock.lock();
+				workerError = std::current_exception();
+				changed.notify_all();
+				return;
+			}
+			lock.lock();
+			if (recordTimeline) timeline.push_back({ iteration, b, start, now() });
+			reduced++;
+			changed.notify_all();
+		}
+	}
+	// Stop the communication thread and detach the network
+	// A bucket still in flight (e.g. after an exception during backward propagation) fails the group so the ring does not wait for it
+	void stop() {
+		if (!worker.joinable()) return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (reduced < launched && !workerError) fail("Rank " + std::to_string(rank) + " stopped while reducing gradients");
+			stopping = true;
+			changed.notify_all();
+		}
+		worker.join();
+		network->gradsReady = nullptr;
+		network = nullptr;
+		launched = reduced = 0;
+		workerError = nullptr;
+	}
+	double* slotOf(int r) { return slots + ((step % 2) * size + r) * slot; }
+	// Throw when another process failed, a worker exited (rank 0) or the launching process exited (other ranks)
+	// A worker that exited is only a failure while the barrier of `generation` is still waiting: the last worker to arrive at a
+	// barrier completes it and may exit before this process sees the new generation
+	void checkPeers(int generation) {
+		int failed = header->failedRank;
+		if (failed >= 0) throw std::runtime_error("Rank " + std::to_string(failed) + " failed: " + header->message);
+		if (rank > 0 && getppid() != parent) throw std::runtime_error("Rank 0 exited");
+		for (int k = 0; k < children.size(); k++) {
+			if (statuses[k] == -1 && waitpid(children[k], &statuses[k], WNOHANG) <= 0) continue;
+			// Read after reaping, so a worker that completed the barrier before exiting is seen
+			if (header->generation.load() != generation) return;
+			int status = statuses[k];
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) throw std::runtime_error("Rank " + std::to_string(k + 1) + " exited unexpectedly");
+			throw std::runtime_error("Rank " + std::to_string(k + 1) + " finished before reaching a barrier");
+		}
+	}
+};
+
+// Example:
+// NNProcessGroup::launch(4, [&](NNProcessGroup& group) {
+// 	group.bucketSize = 1 << 18; // Optional (Before attaching)
+// 	NNTrainer trainer(nn, dataset);
+// 	group.attach(trainer);
+// 	trainer.train(NNOptimizerType::Adam, 10);
+// 	if (group.rank == 0) std::cout << "Overlap efficiency: " << group.overlapEfficiency() << std::endl; // With recordTimeline
+// });
+// Every process ends with the same parameters, so `nn` of the launching process holds the trained network
+
+#endif
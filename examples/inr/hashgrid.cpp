@@ -0,0 +1,106 @@
+// You are recommended to view `examples/inr/main.cpp` first
+#include "../../neural-network.hpp"
+// Include fstream library for saving the network data
+#include <fstream>
+// Include stb_image and stb_image_write.h to load and write image data
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image.h"
+#include "stb_image_write.h"
+
+NeuralNetwork nn;
+const char* imgPath = "./img/img.png";
+int width, height;
+
+// Create the neural representation of the image and save it into `outPath`
+void createImage(const char* outPath) {
+	const int outWidth = 512, outHeight = 512;
+	unsigned char* data = new unsigned char[outWidth * outHeight * 3];
+	for (int i = 0; i < outHeight; i++) {
+		for (int j = 0; j < outWidth; j++) {
+			int idx = i * outWidth + j;
+			double y = static_cast<double>(i) / (outHeight - 1) * 2 - 1;
+			double x = static_cast<double>(j) / (outWidth - 1) * 2 - 1;
+			NNMatrix rgb = nn.run(NNMatrix::fromVector({x, y}));
+			for (int c = 0; c < 3; c++) {
+				// Normalize and clamp from (-1, 1) to (0, 255)
+				double pixel = (rgb[c][0] + 1) * 127.5;
+				data[3 * idx + c] = std::max(0.0, std::min(255.0, pixel));
+			}
+		}
+	}
+	stbi_write_png(outPath, outWidth, outHeight, 3, data, outWidth * 3);
+	delete[] data;
+	data = nullptr;
+}
+
+std::vector<std::pair<NNMatrix, NNMatrix>> batch;
+
+// Load a the image from `imgPath` and create training batch data
+void loadImage() {
+	// Load the image data and metadata such as width and height (0 ignores the number of channels)
+	unsigned char* data = stbi_load(imgPath, &width, &height, 0, 3); // 3 channels expected (RGB)
+	if (data == NULL) {
+		throw std::runtime_error("Error loading image: " + std::string(stbi_failure_reason()));
+	}
+	batch.resize(height * width);
+	for (int i = 0; i < height; i++) {
+		for (int j = 0; j < width; j++) {
+			int idx = i * width + j;
+			std::pair<NNMatrix, NNMatrix> sample;
+			double y = static_cast<double>(i) / (height - 1) * 2 - 1;
+			double x = static_cast<double>(j) / (width - 1) * 2 - 1;
+			sample.first = NNMatrix::fromVector({x, y});
+			sample.second.resize(3,1);
+			for (int c = 0; c < 3; c++) {
+				// Normalize from (0, 255) to (-1, -1)
+				sample.second[c][0] = (static_cast<double>(data[3 * idx + c]) / 127.5) - 1;
+			}
+			batch[idx] = sample;
+		}
+	}
+	stbi_image_free(data);
+}
+
+// Average loss over every pixel of the image
+double avgLoss() {
+	double totalLoss = 0.0;
+	for (std::pair<NNMatrix, NNMatrix>& sample : batch) {
+		totalLoss += nn.lossFn(nn.run(sample.first), sample.second);
+	}
+	return totalLoss / batch.size();
+}
+
+// In this example, we learn the same image as `main.cpp` with a multiresolution hash grid encoding instead of SIREN layers
+// The coordinates are looked up in 8 grids of trainable features from 4x4 to 68x68 cells and a tiny dense head decodes them
+// Only the table entries around the pixels of a sample are updated, so each iteration is cheap,
+// and the grid stores the image detail, so far fewer epochs are needed than with the 2-32-32-3 SIREN
+// Example compilation command: `g++ hashgrid.cpp -O3`
+int main() {
+	nn.addLayer<HashGridEncodingLayer>(2, 8, 2, 12, 4, 1.5);
+	nn.addLayer<DenseLayer>(16, 16);
+	nn.addLayer<ActivationLayer>(16, NNActivationType::ReLU);
+	nn.addLayer<DenseLayer>(16, 3);
+	NNInitialization::heNormal(nn);
+	NNInitialization::hashGridUniform(nn);
+	nn.setLossFunction(NNLossType::MSE);
+
+	// Train the network with adam
+	loadImage();
+	NNTrainer trainer(nn, batch);
+	trainer.learningRate = 0.01;
+	trainer.sampleSize = 128;
+	auto start = std::chrono::high_resolution_clock::now();
+	trainer.epochCallback = [&start]() {
+		double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		std::cout << "Epoch " << nn.epochsTrained << ", Avg Loss: " << avgLoss() << ", " << seconds << "s\n";
+	};
+	trainer.train(NNOptimizerType::Adam, 10);
+	std::cout << "Training finished." << std::endl;
+	createImage("./res_hashgrid.png");
+
+	// Write network data to `./nn_hashgrid.dat`
+	std::ofstream out("./nn_hashgrid.dat", std::ios::binary);
+	nn.save(out, true);
+	out.close();
+}
@@ -0,0 +1,79 @@
+// You are recommended to view `examples/xor/main.cpp` first
+#include "../../neural-network.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+
+// In this example, we benchmark autoregressive decoding with and without a key/value cache
+// The network is a small stack of causal self-attention and position-wise dense layers
+// Every output token is fed back as the next input token
+// Without a cache, each new token reruns the whole prefix through `run()`, so the cost per token grows with the prefix
+// With a cache, `step()` only projects the new token and attends to the cached keys and values
+// Example compilation command: `g++ main.cpp -O3`
+
+const int dModel = 32, heads = 4, tokens = 512;
+
+// Milliseconds elapsed since `start`
+double elapsed(std::chrono::high_resolution_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+int main() {
+	NeuralNetwork nn;
+	nn.addLayer<MultiHeadAttentionLayer>(dModel, heads, true);
+	nn.addLayer<DenseLayer>(dModel, dModel);
+	nn.addLayer<ActivationLayer>(dModel, NNActivationType::Tanh);
+	nn.addLayer<MultiHeadAttentionLayer>(dModel, heads, true);
+	nn.addLayer<DenseLayer>(dModel, dModel);
+	nn.addLayer<ActivationLayer>(dModel, NNActivationType::Tanh);
+	NNInitialization::xavierNormal(nn);
+	NNInitialization::attentionXavier(nn);
+
+	NNMatrix first(dModel, 1);
+	first.forEach([](double *val, int i, int) { *val = std::sin(i); });
+
+	// Uncached decoding: rerun the whole sequence for every new token
+	std::vector<NNMatrix> uncached;
+	NNMatrix sequence = first;
+	std::cout << "Uncached decoding\n";
+	auto start = std::chrono::high_resolution_clock::now();
+	auto lap = start;
+	for (int t = 1; t <= tokens; t++) {
+		NNMatrix out = nn.run(sequence);
+		NNMatrix next(dModel, 1);
+		for (int i = 0; i < dModel; i++) next[i][0] = out[i][t - 1];
+		uncached.push_back(next);
+		for (int i = 0; i < dModel; i++) sequence[i].push_back(next[i][0]);
+		if (t % 128 == 0) {
+			std::cout << "  tokens " << std::setw(4) << t - 127 << "-" << std::setw(4) << t << ": " << elapsed(lap) / 128 << " ms/token\n";
+			lap = std::chrono::high_resolution_clock::now();
+		}
+	}
+	double uncachedTime = elapsed(start);
+
+	// Cached decoding: step one token at a time
+	NNKVCache cache = nn.createKVCache(tokens);
+	NNMatrix token = first;
+	double maxDiff = 0;
+	std::cout << "Cached decoding\n";
+	start = lap = std::chrono::high_resolution_clock::now();
+	for (int t = 1; t <= tokens; t++) {
+		token = nn.step(token, cache);
+		for (int i = 0; i < dModel; i++) maxDiff = std::max(maxDiff, std::abs(token[i][0] - uncached[t - 1][i][0]));
+		if (t % 128 == 0) {
+			std::cout << "  tokens " << std::setw(4) << t - 127 << "-" << std::setw(4) << t << ": " << elapsed(lap) / 128 << " ms/token\n";
+			lap = std::chrono::high_resolution_clock::now();
+		}
+	}
+	double cachedTime = elapsed(start);
+
+	std::cout << "Total: uncached " << uncachedTime << " ms, cached " << cachedTime << " ms (" << uncachedTime / cachedTime << "x faster)\n";
+	std::cout << "Maximum difference between the decoded tokens: " << maxDiff << '\n';
+
+	// With a bounded window, the oldest tokens are evicted and the cost per token stays constant
+	NNKVCache window = nn.createKVCache(64);
+	token = first;
+	start = std::chrono::high_resolution_clock::now();
+	for (int t = 1; t <= tokens; t++) token = nn.step(token, window);
+	std::cout << "Cached decoding with a 64 token window: " << elapsed(start) / tokens << " ms/token\n";
+}
@@ -0,0 +1,124 @@
+// This script trains the MNIST network of `main.cpp` with several processes (data-parallel training)
+// Every process trains on its share of each sample of 128 images and the gradients are summed with a ring all-reduce
+// through shared memory, so all processes keep identical networks
+// The gradients can be compressed by passing `topk`, `int8` or `sign` after the number of processes
+// The MNIST dataset files should be placed in a `./data` folder like for `main.cpp`
+// Important: distributed.hpp uses POSIX processes and shared memory (Linux and macOS)
+// Example compilation command: `g++ distributed.cpp -O3`
+// Example run command: `./a.out 4 int8`
+#include "../../neural-network.hpp"
+#include "../../distributed.hpp"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+// Returns the dataset of from `imgPath` and `lblPath`
+// Adapted from https://stackoverflow.com/questions/8286668/how-to-read-mnist-data-in-c
+std::vector<std::pair<NNMatrix, NNMatrix>> loadMNIST(std::string imgPath, std::string lblPath) {
+	auto reverseInt = [](int i) {
+		unsigned char c1, c2, c3, c4;
+		c1 = i & 255, c2 = (i >> 8) & 255, c3 = (i >> 16) & 255, c4 = (i >> 24) & 255;
+		return ((int)c1 << 24) + ((int)c2 << 16) + ((int)c3 << 8) + c4;
+	};
+	std::ifstream images(imgPath, std::ios::binary);
+	std::ifstream labels(lblPath, std::ios::binary);
+	if (!images.is_open()) throw std::runtime_error("Cannot open image dataset file");
+	if (!labels.is_open()) throw std::runtime_error("Cannot open label dataset file");
+
+	int magicNumber = 0;
+	int totalImages = 0, rows = 0, cols = 0;
+	// Read image magic number
+	images.read((char*)&magicNumber, sizeof(magicNumber)); magicNumber = reverseInt(magicNumber);
+	if(magicNumber != 2051) throw std::runtime_error("Invalid MNIST image file!");
+	// Read total number of images, rows and columns
+	images.read((char*)&totalImages, sizeof(totalImages)), totalImages = reverseInt(totalImages);
+	images.read((char*)&rows, sizeof(rows)), rows = reverseInt(rows);
+	images.read((char*)&cols, sizeof(cols)), cols = reverseInt(cols);
+	// Read label magic number
+	labels.read((char*)&magicNumber, sizeof(magicNumber)); magicNumber = reverseInt(magicNumber);
+	if (magicNumber != 2049) throw std::runtime_error("Invalid MNIST label file!");
+	// Read total number of labels
+	int totalLabels = 0;
+	labels.read((char*)&totalLabels, sizeof(totalLabels)), totalLabels = reverseInt(totalLabels);
+
+	if (totalImages != totalLabels) {
+		throw std::runtime_error(std::to_string(totalImages) + " images found but " + std::to_string(totalLabels) + " labels found.");
+	}
+
+	std::vector<std::pair<NNMatrix, NNMatrix>> dataset(totalImages);
+	for (int i = 0; i < totalImages; i++) {
+		// Form a label column matrix
+		unsigned char label;
+		labels.read((char*)&label, sizeof(label));
+		std::vector<double> expected(10, 0);
+		expected[static_cast<int>(label)] = 1;
+		std::pair<NNMatrix, NNMatrix> pair(NNMatrix(rows*cols, 1), NNMatrix::fromVector(expected));
+		// Read normalized pixel grayscale data
+		for (int r = 0; r < rows; r++) {
+			for (int c = 0; c < cols; c++) {
+				unsigned char pixel = 0;
+				images.read((char*)&pixel, sizeof(pixel));
+				pair.first[r*cols+c][0] = static_cast<double>(pixel) / 255.0;
+			}
+		}
+		dataset[i] = pair;
+	}
+	return dataset;
+}
+
+NeuralNetwork nn;
+std::vector<std::pair<NNMatrix, NNMatrix>> trainset, testset;
+
+// Average loss of the test set
+double avgLoss() {
+	double totalLoss = 0.0;
+	for (int i = 0; i < testset.size(); i++) {
+		totalLoss += nn.lossFn(nn.run(testset[i].first), testset[i].second);
+	}
+	return totalLoss / testset.size();
+}
+
+int main(int argc, char** argv) {
+	int processes = argc > 1 ? std::stoi(argv[1]) : 4;
+	std::string method = argc > 2 ? argv[2] : "none";
+	NNCompressionType compression = NNCompressionType::None;
+	if (method == "topk") compression = NNCompressionType::TopK;
+	else if (method == "int8") compression = NNCompressionType::Int8;
+	else if (method == "sign") compression = NNCompressionType::Sign;
+	else if (method != "none") {
+		std::cerr << "Unknown compression " << method << " (Expected none, topk, int8 or sign)" << std::endl;
+		return 1;
+	}
+	// The datasets and the initialized network are copied into every process when launching
+	trainset = loadMNIST("./data/train-images.idx3-ubyte", "./data/train-labels.idx1-ubyte");
+	testset = loadMNIST("./data/t10k-images.idx3-ubyte", "./data/t10k-labels.idx1-ubyte");
+	nn.addLayer<DenseLayer>(784, 128);
+	nn.addLayer<ActivationLayer>(128, NNActivationType::ReLU);
+	nn.addLayer<DenseLayer>(128, 64);
+	nn.addLayer<ActivationLayer>(64, NNActivationType::ReLU);
+	nn.addLayer<DenseLayer>(64, 10);
+	nn.addLayer<ActivationLayer>(10, NNActivationType::Softmax);
+	nn.setLossFunction(NNLossType::CCE);
+	NNInitialization::heNormal(nn);
+	nn.compile();
+
+	auto start = std::chrono::high_resolution_clock::now();
+	NNProcessGroup::launch(processes, [&compression](NNProcessGroup& group) {
+		NNTrainer trainer(nn, trainset);
+		group.compression = compression;
+		group.attach(trainer);
+		trainer.sampleSize = 128;
+		trainer.packSamples = true;
+		// Only the first process reports progress
+		if (group.rank == 0) trainer.epochCallback = []() { std::cout << "Epoch " << nn.epochsTrained << ", Avg Loss: " << avgLoss() << std::endl; };
+		trainer.train(NNOptimizerType::Adam, 5);
+		if (group.rank == 0) std::cout << "Compression ratio: " << group.compressionRatio() << std::endl;
+	});
+	double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	std::cout << "Trained with " << processes << " processes in " << seconds << "s\n";
+	// The launching process holds the trained network
+	std::ofstream out("./nn-distributed.dat", std::ios::binary);
+	nn.save(out);
+}
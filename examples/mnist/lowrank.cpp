@@ -0,0 +1,111 @@
+// This script compresses the first layer of the trained network in `nn.dat` (see `main.cpp`)
+// The DenseLayer(784, 128) is replaced by a LowRankDenseLayer from the truncated singular value decomposition of its weights
+// Its cost drops from 784 * 128 to rank * (784 + 128) multiplications per sample
+// The testset accuracy and inference time are reported for several ranks
+// The MNIST testset files should be placed in a `./data` folder like for `main.cpp`
+// Example compilation command: `g++ lowrank.cpp -O3`
+#include "../../neural-network.hpp"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+// Returns the dataset of from `imgPath` and `lblPath`
+// Adapted from https://stackoverflow.com/questions/8286668/how-to-read-mnist-data-in-c
+std::vector<std::pair<NNMatrix, NNMatrix>> loadMNIST(std::string imgPath, std::string lblPath) {
+	auto reverseInt = [](int i) {
+		unsigned char c1, c2, c3, c4;
+		c1 = i & 255, c2 = (i >> 8) & 255, c3 = (i >> 16) & 255, c4 = (i >> 24) & 255;
+		return ((int)c1 << 24) + ((int)c2 << 16) + ((int)c3 << 8) + c4;
+	};
+	std::ifstream images(imgPath, std::ios::binary);
+	std::ifstream labels(lblPath, std::ios::binary);
+	if (!images.is_open()) throw std::runtime_error("Cannot open image dataset file");
+	if (!labels.is_open()) throw std::runtime_error("Cannot open label dataset file");
+
+	int magicNumber = 0;
+	int totalImages = 0, rows = 0, cols = 0;
+	// Read image magic number
+	images.read((char*)&magicNumber, sizeof(magicNumber)); magicNumber = reverseInt(magicNumber);
+	if(magicNumber != 2051) throw std::runtime_error("Invalid MNIST image file!");
+	// Read total number of images, rows and columns
+	images.read((char*)&totalImages, sizeof(totalImages)), totalImages = reverseInt(totalImages);
+	images.read((char*)&rows, sizeof(rows)), rows = reverseInt(rows);
+	images.read((char*)&cols, sizeof(cols)), cols = reverseInt(cols);
+	// Read label magic number
+	labels.read((char*)&magicNumber, sizeof(magicNumber)); magicNumber = reverseInt(magicNumber);
+	if (magicNumber != 2049) throw std::runtime_error("Invalid MNIST label file!");
+	// Read total number of labels
+	int totalLabels = 0;
+	labels.read((char*)&totalLabels, sizeof(totalLabels)), totalLabels = reverseInt(totalLabels);
+
+	if (totalImages != totalLabels) {
+		throw std::runtime_error(std::to_string(totalImages) + " images found but " + std::to_string(totalLabels) + " labels found.");
+	}
+
+	std::vector<std::pair<NNMatrix, NNMatrix>> dataset(totalImages);
+	for (int i = 0; i < totalImages; i++) {
+		// Form a label column matrix
+		unsigned char label;
+		labels.read((char*)&label, sizeof(label));
+		std::vector<double> expected(10, 0);
+		expected[static_cast<int>(label)] = 1;
+		std::pair<NNMatrix, NNMatrix> pair(NNMatrix(rows*cols, 1), NNMatrix::fromVector(expected));
+		// Read normalized pixel grayscale data
+		for (int r = 0; r < rows; r++) {
+			for (int c = 0; c < cols; c++) {
+				unsigned char pixel = 0;
+				images.read((char*)&pixel, sizeof(pixel));
+				pair.first[r*cols+c][0] = static_cast<double>(pixel) / 255.0;
+			}
+		}
+		dataset[i] = pair;
+	}
+	return dataset;
+}
+
+std::vector<std::pair<NNMatrix, NNMatrix>> testset;
+
+// Load the trained network from `./nn.dat`
+NeuralNetwork loadNetwork() {
+	NeuralNetwork nn;
+	std::ifstream in("./nn.dat", std::ios::binary);
+	if (!in.good()) throw std::runtime_error("Cannot open network data file");
+	nn.load(in);
+	return nn;
+}
+// Print the testset accuracy and the time taken to run it
+void evaluate(NeuralNetwork& nn, std::string name) {
+	int correct = 0;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (std::pair<NNMatrix, NNMatrix>& sample : testset) {
+		NNMatrix out = nn.run(sample.first);
+		int guess = 0, label = 0;
+		for (int i = 1; i < 10; i++) {
+			if (out[i][0] > out[guess][0]) guess = i;
+			if (sample.second[i][0] > sample.second[label][0]) label = i;
+		}
+		correct += guess == label;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	std::cout << std::setw(16) << name << ": accuracy " << std::fixed << std::setprecision(2) << 100.0 * correct / testset.size() << "%, "
+		<< std::setprecision(3) << seconds << "s\n";
+}
+
+int main() {
+	testset = loadMNIST("./data/t10k-images.idx3-ubyte", "./data/t10k-labels.idx1-ubyte");
+	NeuralNetwork original = loadNetwork();
+	evaluate(original, "Dense");
+	for (int rank : { 96, 64, 32, 16 }) {
+		NeuralNetwork nn = loadNetwork();
+		nn.factorizeDense(0, rank);
+		evaluate(nn, "Rank " + std::to_string(rank));
+	}
+	// Choose the rank from the energy of the singular values instead
+	NeuralNetwork nn = loadNetwork();
+	int rank = nn.factorizeDense(0, 0, 0.9);
+	evaluate(nn, "90% (rank " + std::to_string(rank) + ")");
+	// The factorized network can be fine-tuned with NNTrainer like any other network and saved
+}
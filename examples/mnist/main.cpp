@@ -116,7 +116,7 @@ int main() {
 	nn.addLayer<DenseLayer>(128, 64);
 	nn.addLayer<ActivationLayer>(64, NNActivationType::ReLU);
 	nn.addLayer<DenseLayer>(64, 10);
-	nn.addLayer<ActivationLayer>(128, NNActivationType::Softmax);
+	nn.addLayer<ActivationLayer>(10, NNActivationType::Softmax);
 	nn.setLossFunction(NNLossType::CCE);
 	NNInitialization::heNormal(nn);
 	
@@ -124,12 +124,16 @@ int main() {
 	std::ifstream in("./nn.dat", std::ios::binary);
 	if (in.good()) nn.load(in);
 	in.close();
+	// Check the layer sizes and set up the reused propagation workspace
+	nn.compile();
 
 	std::cout << "Training starting after " << nn.epochsTrained << " epochs and " << nn.iterationsTrained << " iterations.\n";
 	std::cout << "Current average testset loss: " << avgLoss() << '\n';
 	// The loss is usually around log_e(1/10) or ~2.30 after initialization
 	NNTrainer trainer(nn, trainset);
 	trainer.sampleSize = 128;
+	// Split each sample of 128 images across all cores
+	nn.threads = std::max(1u, std::thread::hardware_concurrency());
 	trainer.iterationCallback = iterationCallback;
 	trainer.epochCallback = epochCallback;
 	trainer.train(NNOptimizerType::Adam, 30);
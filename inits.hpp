@@ -92,6 +92,114 @@ namespace NNInitialization {
 		nn.iterationsTrained = nn.epochsTrained = 0;
 	}
 
+	// Recurrent weight initialization
+	// Initialize LSTM and GRU weights uniformly across +- 1/sqrt(hidden) and LSTM forget gate biases to 1
+	inline void recurrentUniform(NeuralNetwork& nn) {
+		std::mt19937 gen(static_cast<unsigned int>(std::chrono::high_resolution_clock::now().time_since_epoch().count()));
+		for (int i = 0; i < nn.depth; i++) {
+			NNMatrix* W = nullptr;
+			int hidden = 0;
+			if (LSTMLayer* layer = dynamic_cast<LSTMLayer*>(nn.layers[i].get())) {
+				W = &layer->W, hidden = layer->hidden;
+				for (int k = 0; k < hidden; k++) layer->B[hidden + k][0] = 1.0;
+			} else if (GRULayer* layer = dynamic_cast<GRULayer*>(nn.layers[i].get())) {
+				W = &layer->W, hidden = layer->hidden;
+			}
+			if (W == nullptr) continue; // Continue for non-recurrent layers
+
+			double limit = 1.0 / std::sqrt(hidden);
+			std::uniform_real_distribution<double> dis(-limit, limit);
+			W->forEach([&dis, &gen](double *val, int, int) {
+				*val = dis(gen);
+			});
+		}
+		nn.iterationsTrained = nn.epochsTrained = 0;
+	}
+	// Convolution weight initialization
+	// Initialize depthwise and pointwise convolution weights with a normal distribution with mean of 0 and standard deviation of sqrt(2/fan-in) (He)
+	// The fan-in is the kernel area for depthwise and the number of input channels for pointwise convolutions
+	inline void convHeNormal(NeuralNetwork& nn) {
+		std::mt19937 gen(static_cast<unsigned int>(std::chrono::high_resolution_clock::now().time_since_epoch().count()));
+		for (int i = 0; i < nn.depth; i++) {
+			NNMatrix* W = nullptr;
+			if (DepthwiseConv2DLayer* layer = dynamic_cast<DepthwiseConv2DLayer*>(nn.layers[i].get())) W = &layer->W;
+			else if (PointwiseConv2DLayer* layer = dynamic_cast<PointwiseConv2DLayer*>(nn.layers[i].get())) W = &layer->W;
+			if (W == nullptr) continue; // Continue for non-convolution layers
+
+			std::normal_distribution<double> dis(0.0, std::sqrt(2.0 / W->cols()));
+			W->forEach([&dis, &gen](double *val, int, int) {
+				*val = dis(gen);
+			});
+		}
+		nn.iterationsTrained = nn.epochsTrained = 0;
+	}
+	// Attention weight initialization
+	// Initialize attention projections uniformly across +- sqrt(6/(2 * dModel)) (Xavier)
+	inline void attentionXavier(NeuralNetwork& nn) {
+		std::mt19937 gen(static_cast<unsigned int>(std::chrono::high_resolution_clock::now().time_since_epoch().count()));
+		for (int i = 0; i < nn.depth; i++) {
+			MultiHeadAttentionLayer* layer = dynamic_cast<MultiHeadAttentionLayer*>(nn.layers[i].get());
+			if (layer == nullptr) continue; // Continue for non-attention layers
+
+			double limit = std::sqrt(6.0 / (2 * layer->inCount));
+			std::uniform_real_distribution<double> dis(-limit, limit);
+			for (NNMatrix* W : { &layer->Wqkv, &layer->Wo }) {
+				W->forEach([&dis, &gen](double *val, int, int) {
+					*val = dis(gen);
+				});
+			}
+		}
+		nn.iterationsTrained = nn.epochsTrained = 0;
+	}
+	// Low rank He initialization
+	// Initialize V with a standard deviation of sqrt(1/in) and U with a standard deviation of sqrt(2/rank)
+	// so the entries of U . V have the He variance of 2/in
+	inline void lowRankHeNormal(NeuralNetwork& nn) {
+		std::mt19937 gen(static_cast<unsigned int>(std::chrono::high_resolution_clock::now().time_since_epoch().count()));
+		for (int i = 0; i < nn.depth; i++) {
+			LowRankDenseLayer* layer = dynamic_cast<LowRankDenseLayer*>(nn.layers[i].get());
+			if (layer == nullptr) continue; // Continue for non-LowRankDenseLayers
+
+			std::normal_distribution<double> disU(0.0, std::sqrt(2.0 / layer->rank)), disV(0.0, std::sqrt(1.0 / layer->inCount));
+			layer->U.forEach([&disU, &gen](double *val, int, int) {
+				*val = disU(gen);
+			});
+			layer->V.forEach([&disV, &gen](double *val, int, int) {
+				*val = disV(gen);
+			});
+		}
+		nn.iterationsTrained = nn.epochsTrained = 0;
+	}
+	// Initialize embedding tables with a normal distribution with mean of 0 and standard deviation of `stddev`
+	inline void embeddingNormal(NeuralNetwork& nn, double stddev = 1.0) {
+		std::mt19937 gen(static_cast<unsigned int>(std::chrono::high_resolution_clock::now().time_since_epoch().count()));
+		std::normal_distribution<double> dis(0.0, stddev);
+		for (int i = 0; i < nn.depth; i++) {
+			EmbeddingLayer* layer = dynamic_cast<EmbeddingLayer*>(nn.layers[i].get());
+			if (layer == nullptr) continue; // Continue for non-EmbeddingLayers
+
+			layer->table.forEach([&dis, &gen](double *val, int, int) {
+				*val = dis(gen);
+			});
+		}
+		nn.iterationsTrained = nn.epochsTrained = 0;
+	}
+
+	// Initialize hash grid tables uniformly across +- `limit`
+	inline void hashGridUniform(NeuralNetwork& nn, double limit = 1e-4) {
+		std::mt19937 gen(static_cast<unsigned int>(std::chrono::high_resolution_clock::now().time_since_epoch().count()));
+		std::uniform_real_distribution<double> dis(-limit, limit);
+		for (int i = 0; i < nn.depth; i++) {
+			HashGridEncodingLayer* layer = dynamic_cast<HashGridEncodingLayer*>(nn.layers[i].get());
+			if (layer == nullptr) continue; // Continue for non-HashGridEncodingLayers
+
+			layer->table.forEach([&dis, &gen](double *val, int, int) {
+				*val = dis(gen);
+			});
+		}
+		nn.iterationsTrained = nn.epochsTrained = 0;
+	}
+
 	// Bias initialization functions
 
 	// Initialize biases to a constant
@@ -10,6 +10,13 @@ public:
 	// Optional parameters and gradients for training
 	std::vector<std::reference_wrapper<NNMatrix>> params;
 	std::vector<NNMatrix> grads;
+	// Optional row-sparse gradients: when enabled, only the rows listed in gradRows[j] (sorted and unique) of grads[j]
+	// are set by backward and all other rows are zero, so the network and optimizers only touch those rows
+	bool sparseGrads = false;
+	std::vector<std::vector<int>> gradRows;
+	// Optional pruning masks with the size of each parameter (1 keeps and 0 prunes an entry, empty when not pruned)
+	// The network reapplies them after every optimizer update so pruned entries stay zero
+	std::vector<NNMatrix> paramMasks;
 	// Optional last input and output storage for backpropagation
 	NNMatrix lastInput, lastOutput;
 
@@ -23,16 +30,48 @@ public:
 	// Sets gradients and returns error for input
 	virtual NNMatrix backward(const NNMatrix& dy) = 0;
 
+	// Whether run() returns its input unchanged so the network can skip the layer during inference
+	virtual bool isIdentity() const { return false; }
+	// Position any randomness of the layer before a forward propagation during training
+	// Stochastic layers derive their randomness only from these coordinates so training is reproducible
+	virtual void seek(int, uint64_t, uint64_t) {}
+	// Free the activations stored by forward() (Used by gradient checkpointing, which recomputes them before backward)
+	virtual void releaseState() {
+		lastInput = NNMatrix();
+		lastOutput = NNMatrix();
+	}
+	// Whether forward() can be called again on the same input with the same result and no other side effects
+	virtual bool recomputable() const { return true; }
+	// Copy of the layer that shares its parameters and has its own gradients and activations (Used for the replicas of multithreaded training)
+	virtual std::unique_ptr<Layer> clone() const { throw std::runtime_error("Layer cannot be cloned"); }
+	// Versions of forward() and backward() writing into a preallocated matrix (Used by compiled networks)
+	// Layers overriding them reuse the storage of `y` or `dx` when its shape matches, so repeated calls do not allocate
+	virtual void forwardInto(const NNMatrix& x, NNMatrix& y) { y = forward(x); }
+	virtual void backwardInto(const NNMatrix& dy, NNMatrix& dx) { dx = backward(dy); }
+
 	// Save layer data to the file stream
 	virtual void save(std::ofstream& out) = 0;
 	// Factory loader
 	static std::unique_ptr<Layer> load(std::ifstream& in);
+protected:
+	// Parameter k in the storage shared by the copies of a layer, so replicas (see clone()) read the parameters of the original
+	// Layers declare their parameters as references into it (e.g. `NNMatrix &W = sharedParam(0);`)
+	NNMatrix& sharedParam(int k) {
+		if (!paramStorage) paramStorage = std::make_shared<std::deque<NNMatrix>>();
+		while (paramStorage->size() <= k) paramStorage->emplace_back(); // A deque keeps references to its elements valid
+		return (*paramStorage)[k];
+	}
+private:
+	std::shared_ptr<std::deque<NNMatrix>> paramStorage;
 };
 
 class ActivationLayer : public Layer {
 public:
 	std::string fnName;
 	std::function<NNMatrix(NNMatrix)> f, g;
+	// In-place activation and error functions of the compiled path
+	void (*fInPlace)(NNMatrix&) = nullptr;
+	void (*gInto)(const NNMatrix&, const NNMatrix&, NNMatrix&) = nullptr;
 	ActivationLayer(int count, std::string fnName) : Layer(count, count), fnName(fnName) {
 		if (fnName == NNActivationType::Sigmoid) {
 			f = NNActivation::sigmoid;
@@ -47,11 +86,28 @@ public:
 			f = NNActivation::softmax;
 			g = [this](NNMatrix dy) { return NNActivation::softmaxDerivative(lastOutput, dy); };
 		} else throw std::runtime_error("Unknown hidden activation function ('" + fnName + "')");
+		inPlaceFunctions(fnName, fInPlace, gInto);
+	}
+	// In-place activation and error functions of an activation function name (Shared with FusedDenseLayer)
+	static void inPlaceFunctions(const std::string& fnName, void (*&f)(NNMatrix&), void (*&g)(const NNMatrix&, const NNMatrix&, NNMatrix&)) {
+		if (fnName == NNActivationType::Sigmoid) f = NNActivation::sigmoidInPlace, g = NNActivation::sigmoidBackward;
+		else if (fnName == NNActivationType::ReLU) f = NNActivation::reluInPlace, g = NNActivation::reluBackward;
+		else if (fnName == NNActivationType::Tanh) f = NNActivation::tanhInPlace, g = NNActivation::tanhBackward;
+		else if (fnName == NNActivationType::Softmax) f = NNActivation::softmaxInPlace, g = NNActivation::softmaxBackward;
+		else throw std::runtime_error("Unknown hidden activation function ('" + fnName + "')");
 	}
 
 	NNMatrix run(const NNMatrix& x) override { return f(x); }
 	NNMatrix forward(const NNMatrix& x) override { lastOutput = f(x); return lastOutput; }
 	NNMatrix backward(const NNMatrix& dy) override { return g(dy); }
+	void forwardInto(const NNMatrix& x, NNMatrix& y) override {
+		lastOutput = x;
+		fInPlace(lastOutput);
+		y = lastOutput;
+	}
+	void backwardInto(const NNMatrix& dy, NNMatrix& dx) override { gInto(lastOutput, dy, dx); }
+	// The derivative captures this layer, so it is rebuilt instead of copied
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<ActivationLayer>(inCount, fnName); }
 
 	void save(std::ofstream& out) override {
 		// Write the layer type
@@ -81,9 +137,100 @@ public:
 	}
 };
 
+// Persistent threads that each run the jobs of one shard (Used by DenseLayer::shards)
+// Copies start without threads, so copies of a layer (e.g. replicas) get their own
+class NNShardPool {
+public:
+	NNShardPool() = default;
+	NNShardPool(const NNShardPool&) {}
+	NNShardPool& operator=(const NNShardPool&) { return *this; }
+	~NNShardPool() { stop(); }
+	// Run job(s) for every shard s in [0, count) and wait for them (Shard 0 runs on the calling thread)
+	// The threads are recreated when the number of shards changes
+	// While another thread is using the pool (e.g. concurrent run() calls of a network), the shards run one after the other on
+	// the calling thread instead, which gives the same results
+	void run(int count, const std::function<void(int)>& job) {
+		std::unique_lock<std::mutex> owner(busy, std::try_to_lock);
+		if (count <= 1 || !owner.owns_lock()) {
+			for (int s = 0; s < count; s++) job(s);
+			return;
+		}
+		if (workers.size() != count - 1) {
+			stop();
+			stopping = false;
+			for (int s = 1; s < count; s++) workers.emplace_back(&NNShardPool::loop, this, s, generation);
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			current = &job;
+			pending = count - 1;
+			error = nullptr;
+			generation++;
+		}
+		wake.notify_all();
+		std::exception_ptr own;
+		try {
+			job(0);
+		} catch (...) {
+			own = std::current_exception();
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this]() { return pending == 0; });
+		if (own) std::rethrow_exception(own);
+		if (error) std::rethrow_exception(error);
+	}
+private:
+	std::vector<std::thread> workers;
+	// Held by the thread whose jobs the workers run
+	std::mutex busy;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const std::function<void(int)>* current = nullptr;
+	long long generation = 0;
+	int pending = 0;
+	bool stopping = false;
+	std::exception_ptr error;
+
+	// Run shard s of every job after the job `seen`
+	void loop(int s, long long seen) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			wake.wait(lock, [this, seen]() { return stopping || generation != seen; });
+			if (stopping) return;
+			seen = generation;
+			const std::function<void(int)>& job = *current;
+			lock.unlock();
+			std::exception_ptr failure;
+			try {
+				job(s);
+			} catch (...) {
+				failure = std::current_exception();
+			}
+			lock.lock();
+			if (failure && !error) error = failure;
+			if (--pending == 0) done.notify_all();
+		}
+	}
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread& worker : workers) worker.join();
+		workers.clear();
+	}
+};
+
 class DenseLayer : public Layer {
 public:
-	NNMatrix W, B;
+	NNMatrix &W = sharedParam(0), &B = sharedParam(1);
+	// Optional tensor parallelism for very wide layers (Not saved)
+	// With shards > 1, the output neurons (rows of W and B) are split into `shards` contiguous slices, each owned by one thread
+	// in run(), forward() and backward() and in the NNTrainer update, so a thread only touches its slice of the weights,
+	// gradients and optimizer state. Each slice writes its rows of the output, and the input errors W_s^T . dy_s of the
+	// slices are summed in slice order at the end of backward()
+	int shards = 1;
 	DenseLayer(int in, int out) : Layer(in, out) {
 		W.resize(out, in);
 		B.resize(out, 1);
@@ -93,13 +240,44 @@ public:
 		grads[1].resize(out, 1);
 	}
 
-	NNMatrix run(const NNMatrix& x) override { return NNMatrix::dot(W, x) + B; } // y = W . x + B
+	// Each column of x is a separate sample and B is added to all of them
+	NNMatrix run(const NNMatrix& x) override { // y = W . x + B
+		NNMatrix y;
+		affine(x, y);
+		return y;
+	}
 	NNMatrix forward(const NNMatrix& x) override { lastInput = x; return run(x); }
 	NNMatrix backward(const NNMatrix& dy) override {
-		grads[0] = NNMatrix::dot(dy, lastInput.transpose()); // dW = dy . x^T
-		grads[1] = dy; // dB = dy
-		return NNMatrix::dot(W.transpose(), dy); // dx = W^T . dy
+		NNMatrix dx;
+		backwardInto(dy, dx);
+		return dx;
+	}
+	void forwardInto(const NNMatrix& x, NNMatrix& y) override {
+		lastInput = x;
+		affine(x, y);
+	}
+	void backwardInto(const NNMatrix& dy, NNMatrix& dx) override {
+		if (shards > 1) {
+			shardedBackward(dy, dx);
+			return;
+		}
+		NNMatrix::dot(W, dy, dx, true); // dx = W^T . dy
+		NNMatrix::dot(dy, lastInput, grads[0], false, true); // dW = dy . x^T
+		for (int i = 0; i < outCount; i++) { // dB = dy (summed over samples)
+			double sum = 0;
+			for (double val : dy[i]) sum += val;
+			grads[1][i][0] = sum;
+		}
+	}
+	// Run f(shard, begin, end) for the row range [begin, end) of every shard, each on its own thread (Shard 0 on the calling thread)
+	// A shard always runs on the same persistent thread, so its slice of the weights stays in that thread's cache
+	// Concurrent calls (e.g. run() from several threads) do not share the threads: the shards of all but one run on their caller
+	template<typename F>
+	void forEachShard(F f) const {
+		int count = std::max(1, std::min(shards, outCount));
+		pool.run(count, [this, &f, count](int s) { f(s, outCount * s / count, outCount * (s + 1) / count); });
 	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<DenseLayer>(*this); }
 
 	void save(std::ofstream& out) override {
 		// Write the layer type
@@ -132,11 +310,293 @@ public:
 		}
 		return layer;
 	}
+private:
+	// Input error of every shard, summed into dx
+	std::vector<NNMatrix> shardErrors;
+	// Threads running the shards after the first (Created when `shards` changes, not shared by copies)
+	mutable NNShardPool pool;
+
+	// y = W . x + B with the rows of y computed by their shards
+	void affine(const NNMatrix& x, NNMatrix& y) {
+		if (shards <= 1) {
+			NNMatrix::dot(W, x, y, false);
+			y.addToColumns(B);
+			return;
+		}
+		if (x.rows() != inCount) throw std::runtime_error("Dense layer takes " + std::to_string(inCount) + " rows but the input has " + std::to_string(x.rows()));
+		y.resize(outCount, x.cols());
+		forEachShard([this, &x, &y](int, int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				std::vector<double>& yi = y[i];
+				std::fill(yi.begin(), yi.end(), 0.0);
+				for (int p = 0; p < inCount; p++) {
+					double wip = W[i][p];
+					const std::vector<double>& xp = x[p];
+					for (int j = 0; j < x.cols(); j++) yi[j] += wip * xp[j];
+				}
+				for (double& val : yi) val += B[i][0];
+			}
+		});
+	}
+	// Gradients of the rows of each shard and the sum of the input errors of the shards
+	void shardedBackward(const NNMatrix& dy, NNMatrix& dx) {
+		if (dy.rows() != outCount || dy.cols() != lastInput.cols()) {
+			throw std::runtime_error("Dense layer error must be " + std::to_string(outCount) + "x" + std::to_string(lastInput.cols()));
+		}
+		int count = std::max(1, std::min(shards, outCount));
+		shardErrors.resize(count);
+		forEachShard([this, &dy](int s, int begin, int end) {
+			const NNMatrix& x = lastInput;
+			for (int i = begin; i < end; i++) {
+				// dW = dy . x^T and dB = dy (summed over samples)
+				double sum = 0;
+				for (int p = 0; p < inCount; p++) {
+					double dot = 0;
+					for (int j = 0; j < x.cols(); j++) dot += dy[i][j] * x[p][j];
+					grads[0][i][p] = dot;
+				}
+				for (double val : dy[i]) sum += val;
+				grads[1][i][0] = sum;
+			}
+			// dx_s = W_s^T . dy_s
+			NNMatrix& e = shardErrors[s];
+			e.resize(inCount, dy.cols());
+			for (std::vector<double>& row : e.data) std::fill(row.begin(), row.end(), 0.0);
+			for (int i = begin; i < end; i++) {
+				for (int p = 0; p < inCount; p++) {
+					double wip = W[i][p];
+					for (int j = 0; j < dy.cols(); j++) e[p][j] += wip * dy[i][j];
+				}
+			}
+		});
+		dx = shardErrors[0];
+		for (int s = 1; s < count; s++) {
+			for (int p = 0; p < inCount; p++) {
+				for (int j = 0; j < dx.cols(); j++) dx[p][j] += shardErrors[s][p][j];
+			}
+		}
+	}
+};
+
+// Dense layer followed by an activation in a single layer (Created by NeuralNetwork::optimize())
+// The activation is applied in place to the output of the dense product, so no intermediate matrix is made or stored
+class FusedDenseLayer : public Layer {
+public:
+	std::string fnName;
+	NNMatrix &W = sharedParam(0), &B = sharedParam(1);
+	void (*fInPlace)(NNMatrix&) = nullptr;
+	void (*gInto)(const NNMatrix&, const NNMatrix&, NNMatrix&) = nullptr;
+	FusedDenseLayer(int in, int out, std::string fnName) : Layer(in, out), fnName(fnName) {
+		ActivationLayer::inPlaceFunctions(fnName, fInPlace, gInto);
+		W.resize(out, in);
+		B.resize(out, 1);
+		params = { std::ref(W), std::ref(B) };
+		grads.resize(2);
+		grads[0].resize(out, in);
+		grads[1].resize(out, 1);
+	}
+	// Fused layer with the parameters of a DenseLayer and the function of the ActivationLayer after it
+	static std::unique_ptr<FusedDenseLayer> fromLayers(const DenseLayer& dense, const ActivationLayer& activation) {
+		std::unique_ptr<FusedDenseLayer> layer = std::make_unique<FusedDenseLayer>(dense.inCount, dense.outCount, activation.fnName);
+		layer->W = dense.W;
+		layer->B = dense.B;
+		return layer;
+	}
+
+	NNMatrix run(const NNMatrix& x) override { // y = f(W . x + B)
+		NNMatrix y;
+		NNMatrix::dot(W, x, y, false);
+		y.addToColumns(B);
+		fInPlace(y);
+		return y;
+	}
+	NNMatrix forward(const NNMatrix& x) override {
+		NNMatrix y;
+		forwardInto(x, y);
+		return y;
+	}
+	NNMatrix backward(const NNMatrix& dy) override {
+		NNMatrix dx;
+		backwardInto(dy, dx);
+		return dx;
+	}
+	void forwardInto(const NNMatrix& x, NNMatrix& y) override {
+		lastInput = x;
+		NNMatrix::dot(W, x, lastOutput, false);
+		lastOutput.addToColumns(B);
+		fInPlace(lastOutput);
+		y = lastOutput;
+	}
+	void backwardInto(const NNMatrix& dy, NNMatrix& dx) override {
+		gInto(lastOutput, dy, dz); // Error of the dense output
+		NNMatrix::dot(W, dz, dx, true); // dx = W^T . dz
+		NNMatrix::dot(dz, lastInput, grads[0], false, true); // dW = dz . x^T
+		for (int i = 0; i < outCount; i++) { // dB = dz (summed over samples)
+			double sum = 0;
+			for (double val : dz[i]) sum += val;
+			grads[1][i][0] = sum;
+		}
+	}
+	void releaseState() override {
+		Layer::releaseState();
+		dz = NNMatrix();
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<FusedDenseLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "FusedDense";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the number of input and output neurons
+		out.write(reinterpret_cast<const char*>(&inCount), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&outCount), sizeof(int));
+		// Write the activation function name
+		size = fnName.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(fnName.c_str(), size);
+		// Write the weights and biases
+		for (NNMatrix& param : params) {
+			param.forEach([&out](double *val, int, int) {
+				out.write(reinterpret_cast<const char*>(val), sizeof(double));
+			});
+		}
+	}
+	static std::unique_ptr<FusedDenseLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the number of input and output neurons
+		int inCount, outCount;
+		in.read(reinterpret_cast<char*>(&inCount), sizeof(int));
+		in.read(reinterpret_cast<char*>(&outCount), sizeof(int));
+		// Read the activation function
+		uint32_t size;
+		in.read(reinterpret_cast<char*>(&size), sizeof(uint32_t));
+		std::string fnName;
+		fnName.resize(size);
+		in.read(&fnName[0], size);
+		std::unique_ptr<FusedDenseLayer> layer = std::make_unique<FusedDenseLayer>(inCount, outCount, fnName);
+		// Read the weights and biases
+		for (NNMatrix& mat : layer->params) {
+			for (int i = 0; i < mat.rows(); i++) {
+				in.read(reinterpret_cast<char*>(mat[i].data()), mat.cols() * sizeof(double));
+			}
+		}
+		return layer;
+	}
+private:
+	NNMatrix dz;
+};
+
+// Dense layer with its weights factorized into W = U . V where U is out x rank and V is rank x in
+// It costs rank * (in + out) multiplications per sample instead of in * out
+class LowRankDenseLayer : public Layer {
+public:
+	int rank;
+	NNMatrix &U = sharedParam(0), &V = sharedParam(1), &B = sharedParam(2);
+	NNMatrix lastH;
+	LowRankDenseLayer(int in, int out, int rank) : Layer(in, out), rank(rank) {
+		if (rank <= 0 || rank > std::min(in, out)) throw std::runtime_error("Low rank dense layer rank must be between 1 and " + std::to_string(std::min(in, out)));
+		U.resize(out, rank);
+		V.resize(rank, in);
+		B.resize(out, 1);
+		params = { std::ref(U), std::ref(V), std::ref(B) };
+		grads.resize(3);
+		grads[0].resize(out, rank);
+		grads[1].resize(rank, in);
+		grads[2].resize(out, 1);
+	}
+
+	// Convert a dense layer with a truncated singular value decomposition W ≈ Ur . diag(Sr) . Vr^T
+	// The rank is the smallest one keeping `energy` of the sum of squared singular values, capped at `maxRank` (if positive)
+	// The singular values are split evenly as U = Ur . diag(sqrt(Sr)) and V = diag(sqrt(Sr)) . Vr^T
+	static std::unique_ptr<LowRankDenseLayer> fromDense(const DenseLayer& dense, int maxRank, double energy = 1.0) {
+		NNMatrix u, v;
+		std::vector<double> s;
+		NNMatrix::svd(dense.W, u, s, v);
+		double total = 0;
+		for (double val : s) total += val * val;
+		int rank = 1;
+		double kept = s[0] * s[0];
+		while (rank < s.size() && kept < energy * total) {
+			kept += s[rank] * s[rank];
+			rank++;
+		}
+		if (maxRank > 0) rank = std::min(rank, maxRank);
+		std::unique_ptr<LowRankDenseLayer> layer = std::make_unique<LowRankDenseLayer>(dense.inCount, dense.outCount, rank);
+		for (int k = 0; k < rank; k++) {
+			double scale = std::sqrt(s[k]);
+			for (int i = 0; i < dense.outCount; i++) layer->U[i][k] = u[i][k] * scale;
+			for (int j = 0; j < dense.inCount; j++) layer->V[k][j] = v[j][k] * scale;
+		}
+		layer->B = dense.B;
+		return layer;
+	}
+
+	NNMatrix run(const NNMatrix& x) override { // y = U . (V . x) + B
+		NNMatrix y = NNMatrix::dot(U, NNMatrix::dot(V, x));
+		y.addToColumns(B);
+		return y;
+	}
+	NNMatrix forward(const NNMatrix& x) override {
+		lastInput = x;
+		lastH = NNMatrix::dot(V, x); // h = V . x
+		NNMatrix y = NNMatrix::dot(U, lastH);
+		y.addToColumns(B);
+		return y;
+	}
+	NNMatrix backward(const NNMatrix& dy) override {
+		grads[0] = NNMatrix::dot(dy, lastH.transpose()); // dU = dy . h^T
+		NNMatrix dh = NNMatrix::dot(U.transpose(), dy); // dh = U^T . dy
+		grads[1] = NNMatrix::dot(dh, lastInput.transpose()); // dV = dh . x^T
+		grads[2] = dy.rowSum(); // dB = dy (summed over samples)
+		return NNMatrix::dot(V.transpose(), dh); // dx = V^T . dh
+	}
+	void releaseState() override {
+		Layer::releaseState();
+		lastH = NNMatrix();
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<LowRankDenseLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "LowRankDense";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the number of input and output neurons and the rank
+		out.write(reinterpret_cast<const char*>(&inCount), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&outCount), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&rank), sizeof(int));
+		// Write the factors and biases
+		for (NNMatrix& param : params) {
+			param.forEach([&out](double *val, int, int) {
+				out.write(reinterpret_cast<const char*>(val), sizeof(double));
+			});
+		}
+	}
+	static std::unique_ptr<LowRankDenseLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the number of input and output neurons and the rank
+		int inCount, outCount, rank;
+		in.read(reinterpret_cast<char*>(&inCount), sizeof(int));
+		in.read(reinterpret_cast<char*>(&outCount), sizeof(int));
+		in.read(reinterpret_cast<char*>(&rank), sizeof(int));
+		std::unique_ptr<LowRankDenseLayer> layer = std::make_unique<LowRankDenseLayer>(inCount, outCount, rank);
+		// Read the factors and biases
+		for (NNMatrix& mat : layer->params) {
+			for (int i = 0; i < mat.rows(); i++) {
+				in.read(reinterpret_cast<char*>(mat[i].data()), mat.cols() * sizeof(double));
+			}
+		}
+		return layer;
+	}
 };
 
 class SIRENLayer : public Layer {
 public:
-	NNMatrix W, B, lastZ;
+	NNMatrix &W = sharedParam(0), &B = sharedParam(1);
+	NNMatrix lastZ;
 	double omega0 = 1.0;
 	SIRENLayer(int in, int out) : Layer(in, out) {
 		W.resize(out, in);
@@ -148,7 +608,8 @@ public:
 	}
 
 	NNMatrix run(const NNMatrix& x) override {
-		NNMatrix z = NNMatrix::dot(W, x) + B; // z = W . x + B
+		NNMatrix z = NNMatrix::dot(W, x); // z = W . x + B
+		z.addToColumns(B);
 		z.forEach([this](double *val, int, int) {
 			*val = std::sin(omega0 * *val); // y = sin(omega0 * z)
 		});
@@ -156,7 +617,8 @@ public:
 	}
 	NNMatrix forward(const NNMatrix& x) override {
 		lastInput = x;
-		NNMatrix z = NNMatrix::dot(W, x) + B; // z = W . x + B
+		NNMatrix z = NNMatrix::dot(W, x); // z = W . x + B
+		z.addToColumns(B);
 		lastZ = z;
 		z.forEach([this](double *val, int, int) {
 			*val = std::sin(omega0 * *val); // y = sin(omega0 * z)
@@ -169,9 +631,14 @@ public:
 			*val = dy[i][j] * omega0 * std::cos(omega0 * *val);
 		});
 		grads[0] = NNMatrix::dot(dz, lastInput.transpose()); // dW = dz . x^T
-		grads[1] = dz; // dB = dz
+		grads[1] = dz.rowSum(); // dB = dz (summed over samples)
 		return NNMatrix::dot(W.transpose(), dz); // dx = W^T . dz
 	}
+	void releaseState() override {
+		Layer::releaseState();
+		lastZ = NNMatrix();
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<SIRENLayer>(*this); }
 
 	void save(std::ofstream& out) override {
 		// Write the layer type
@@ -210,6 +677,1734 @@ public:
 	}
 };
 
+class BatchNormLayer : public Layer {
+public:
+	NNMatrix &gamma = sharedParam(0), &beta = sharedParam(1);
+	NNMatrix runningMean, runningVar;
+	double momentum = 0.9, epsilon = 1e-5;
+	// Normalizes each neuron over the columns (samples) of the input, then scales by gamma and shifts by beta
+	// A single column cannot be normalized by its own statistics, so it is normalized with the running statistics instead
+	BatchNormLayer(int count, double momentum = 0.9, double epsilon = 1e-5) : Layer(count, count), momentum(momentum), epsilon(epsilon) {
+		gamma.resize(count, 1);
+		beta.resize(count, 1);
+		gamma.fill(1);
+		runningMean.resize(count, 1);
+		runningVar.resize(count, 1);
+		runningVar.fill(1);
+		params = { std::ref(gamma), std::ref(beta) };
+		grads.resize(2);
+		grads[0].resize(count, 1);
+		grads[1].resize(count, 1);
+	}
+
+	// Normalize with the running statistics (Inference)
+	NNMatrix run(const NNMatrix& x) override {
+		NNMatrix y(outCount, x.cols());
+		for (int i = 0; i < outCount; i++) {
+			double scale = gamma[i][0] / std::sqrt(runningVar[i][0] + epsilon);
+			double shift = beta[i][0] - runningMean[i][0] * scale;
+			for (int j = 0; j < x.cols(); j++) y[i][j] = x[i][j] * scale + shift;
+		}
+		return y;
+	}
+	// Normalize with the batch statistics, update the running statistics and keep the normalized input for backward
+	NNMatrix forward(const NNMatrix& x) override {
+		int n = x.cols();
+		NNMatrix y(outCount, n);
+		lastXHat.resize(outCount, n);
+		lastInvStd.resize(outCount, 1);
+		for (int i = 0; i < outCount; i++) {
+			double mean = 0, var = 0;
+			if (n > 1) {
+				for (int j = 0; j < n; j++) mean += x[i][j];
+				mean /= n;
+				for (int j = 0; j < n; j++) var += (x[i][j] - mean) * (x[i][j] - mean);
+				var /= n;
+				runningMean[i][0] = momentum * runningMean[i][0] + (1 - momentum) * mean;
+				runningVar[i][0] = momentum * runningVar[i][0] + (1 - momentum) * var * n / (n - 1); // Unbiased
+			} else {
+				double d = x[i][0] - runningMean[i][0];
+				runningMean[i][0] += (1 - momentum) * d;
+				runningVar[i][0] = momentum * (runningVar[i][0] + (1 - momentum) * d * d);
+				mean = runningMean[i][0];
+				var = runningVar[i][0];
+			}
+			double invStd = 1.0 / std::sqrt(var + epsilon);
+			lastInvStd[i][0] = invStd;
+			for (int j = 0; j < n; j++) {
+				double xHat = (x[i][j] - mean) * invStd;
+				lastXHat[i][j] = xHat;
+				y[i][j] = gamma[i][0] * xHat + beta[i][0];
+			}
+		}
+		return y;
+	}
+	NNMatrix backward(const NNMatrix& dy) override {
+		int n = dy.cols();
+		NNMatrix dx(inCount, n);
+		for (int i = 0; i < outCount; i++) {
+			double dGamma = 0, dBeta = 0;
+			for (int j = 0; j < n; j++) {
+				dGamma += dy[i][j] * lastXHat[i][j]; // dγ = ∑ dy * x̂
+				dBeta += dy[i][j]; // dβ = ∑ dy
+			}
+			grads[0][i][0] = dGamma;
+			grads[1][i][0] = dBeta;
+			double k = gamma[i][0] * lastInvStd[i][0];
+			if (n > 1) {
+				// dx = γ/σ * (dy - (dβ + x̂ * dγ) / n)
+				for (int j = 0; j < n; j++) dx[i][j] = k * (dy[i][j] - (dBeta + lastXHat[i][j] * dGamma) / n);
+			} else {
+				// Running statistics are treated as constants
+				dx[i][0] = k * dy[i][0];
+			}
+		}
+		return dx;
+	}
+	// Recomputing would update the running statistics twice, so gradient checkpointing keeps its activations
+	bool recomputable() const override { return false; }
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<BatchNormLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "BatchNorm";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the number of neurons, momentum and epsilon
+		out.write(reinterpret_cast<const char*>(&inCount), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&momentum), sizeof(double));
+		out.write(reinterpret_cast<const char*>(&epsilon), sizeof(double));
+		// Write gamma, beta and the running statistics
+		for (NNMatrix* mat : { &gamma, &beta, &runningMean, &runningVar }) {
+			mat->forEach([&out](double *val, int, int) {
+				out.write(reinterpret_cast<const char*>(val), sizeof(double));
+			});
+		}
+	}
+	static std::unique_ptr<BatchNormLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the number of neurons, momentum and epsilon
+		int count;
+		double momentum, epsilon;
+		in.read(reinterpret_cast<char*>(&count), sizeof(int));
+		in.read(reinterpret_cast<char*>(&momentum), sizeof(double));
+		in.read(reinterpret_cast<char*>(&epsilon), sizeof(double));
+		std::unique_ptr<BatchNormLayer> layer = std::make_unique<BatchNormLayer>(count, momentum, epsilon);
+		// Read gamma, beta and the running statistics
+		for (NNMatrix* mat : { &layer->gamma, &layer->beta, &layer->runningMean, &layer->runningVar }) {
+			for (int i = 0; i < mat->rows(); i++) {
+				in.read(reinterpret_cast<char*>((*mat)[i].data()), mat->cols() * sizeof(double));
+			}
+		}
+		return layer;
+	}
+private:
+	// Normalized input and inverse standard deviations of the last forward propagation
+	NNMatrix lastXHat, lastInvStd;
+};
+
+class LayerNormLayer : public Layer {
+public:
+	NNMatrix &gamma = sharedParam(0), &beta = sharedParam(1);
+	double epsilon = 1e-5;
+	// Normalizes each column (sample) over its neurons, then scales by gamma and shifts by beta
+	LayerNormLayer(int count, double epsilon = 1e-5) : Layer(count, count), epsilon(epsilon) {
+		gamma.resize(count, 1);
+		beta.resize(count, 1);
+		gamma.fill(1);
+		params = { std::ref(gamma), std::ref(beta) };
+		grads.resize(2);
+		grads[0].resize(count, 1);
+		grads[1].resize(count, 1);
+	}
+
+	NNMatrix run(const NNMatrix& x) override { return normalize(x, false); }
+	NNMatrix forward(const NNMatrix& x) override { lastInput = x; return normalize(x, true); }
+	NNMatrix backward(const NNMatrix& dy) override {
+		int n = inCount;
+		NNMatrix dx(n, dy.cols());
+		grads[0].fill(0);
+		grads[1].fill(0);
+		for (int j = 0; j < dy.cols(); j++) {
+			double mean = lastMean[j], invStd = lastInvStd[j];
+			// First pass: parameter gradients and the means of g = γ * dy and g * x̂
+			double gMean = 0, gxMean = 0;
+			for (int i = 0; i < n; i++) {
+				double xHat = (lastInput[i][j] - mean) * invStd;
+				double g = gamma[i][0] * dy[i][j];
+				grads[0][i][0] += dy[i][j] * xHat; // dγ = ∑ dy * x̂
+				grads[1][i][0] += dy[i][j]; // dβ = ∑ dy
+				gMean += g;
+				gxMean += g * xHat;
+			}
+			gMean /= n;
+			gxMean /= n;
+			// Second pass: dx = (g - mean(g) - x̂ * mean(g * x̂)) / σ
+			for (int i = 0; i < n; i++) {
+				double xHat = (lastInput[i][j] - mean) * invStd;
+				dx[i][j] = (gamma[i][0] * dy[i][j] - gMean - xHat * gxMean) * invStd;
+			}
+		}
+		return dx;
+	}
+	void releaseState() override {
+		Layer::releaseState();
+		lastMean = std::vector<double>();
+		lastInvStd = std::vector<double>();
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<LayerNormLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "LayerNorm";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the number of neurons and epsilon
+		out.write(reinterpret_cast<const char*>(&inCount), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&epsilon), sizeof(double));
+		// Write gamma and beta
+		for (NNMatrix& param : params) {
+			param.forEach([&out](double *val, int, int) {
+				out.write(reinterpret_cast<const char*>(val), sizeof(double));
+			});
+		}
+	}
+	static std::unique_ptr<LayerNormLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the number of neurons and epsilon
+		int count;
+		double epsilon;
+		in.read(reinterpret_cast<char*>(&count), sizeof(int));
+		in.read(reinterpret_cast<char*>(&epsilon), sizeof(double));
+		std::unique_ptr<LayerNormLayer> layer = std::make_unique<LayerNormLayer>(count, epsilon);
+		// Read gamma and beta
+		for (NNMatrix& mat : layer->params) {
+			for (int i = 0; i < mat.rows(); i++) {
+				in.read(reinterpret_cast<char*>(mat[i].data()), mat.cols() * sizeof(double));
+			}
+		}
+		return layer;
+	}
+private:
+	// Mean and inverse standard deviation of each column of the last input
+	std::vector<double> lastMean, lastInvStd;
+
+	// Single pass normalization: Welford's algorithm gives the mean and variance, then scale and shift are applied
+	NNMatrix normalize(const NNMatrix& x, bool store) {
+		int n = inCount;
+		NNMatrix y(n, x.cols());
+		if (store) {
+			lastMean.resize(x.cols());
+			lastInvStd.resize(x.cols());
+		}
+		for (int j = 0; j < x.cols(); j++) {
+			double mean = 0, m2 = 0;
+			for (int i = 0; i < n; i++) {
+				double delta = x[i][j] - mean;
+				mean += delta / (i + 1);
+				m2 += delta * (x[i][j] - mean);
+			}
+			double invStd = 1.0 / std::sqrt(m2 / n + epsilon);
+			if (store) {
+				lastMean[j] = mean;
+				lastInvStd[j] = invStd;
+			}
+			for (int i = 0; i < n; i++) y[i][j] = (x[i][j] - mean) * invStd * gamma[i][0] + beta[i][0];
+		}
+		return y;
+	}
+};
+
+class DropoutLayer : public Layer {
+public:
+	double rate;
+	uint64_t seed;
+	// Zeroes each input with probability `rate` during training and scales the rest by 1 / (1 - rate)
+	// The mask is generated by a Philox counter-based generator straight into a packed bitmask, keyed by
+	// (seed, layer index, iteration, sample), so masks are reproducible however the samples are scheduled
+	DropoutLayer(int count, double rate, uint64_t seed = 0) : Layer(count, count), rate(rate), seed(seed) {
+		if (rate < 0 || rate >= 1) throw std::runtime_error("Dropout rate must be in [0, 1)");
+	}
+
+	bool isIdentity() const override { return true; }
+	void seek(int index, uint64_t iteration, uint64_t sample) override {
+		uint64_t key = NNRandom::mix(seed ^ NNRandom::mix(static_cast<uint64_t>(index)));
+		key0 = static_cast<uint32_t>(key);
+		key1 = static_cast<uint32_t>(key >> 32);
+		this->iteration = iteration;
+		this->sample = sample;
+	}
+
+	NNMatrix run(const NNMatrix& x) override { return x; }
+	NNMatrix forward(const NNMatrix& x) override {
+		// Keep an element when its 32-bit random value is below the threshold
+		uint32_t threshold = static_cast<uint32_t>((1.0 - rate) * 4294967296.0 - 1.0);
+		double scale = 1.0 / (1.0 - rate);
+		mask.assign((static_cast<size_t>(outCount) * x.cols() + 63) / 64, 0);
+		NNMatrix y(outCount, x.cols());
+		for (int j = 0; j < x.cols(); j++) {
+			// Every column is a separate sample with its own counter
+			uint64_t s = sample + j;
+			for (int i = 0; i < outCount; i += 4) {
+				NNRandom::Philox4x32 r = NNRandom::philox(
+					static_cast<uint32_t>(i), static_cast<uint32_t>(s), static_cast<uint32_t>(iteration), static_cast<uint32_t>(iteration >> 32),
+					key0, key1
+				);
+				for (int k = 0; k < 4 && i + k < outCount; k++) {
+					if (r.v[k] > threshold) continue;
+					size_t bit = static_cast<size_t>(j) * outCount + i + k;
+					mask[bit / 64] |= 1ull << (bit % 64);
+					y[i + k][j] = x[i + k][j] * scale;
+				}
+			}
+		}
+		return y;
+	}
+	NNMatrix backward(const NNMatrix& dy) override {
+		double scale = 1.0 / (1.0 - rate);
+		NNMatrix dx(inCount, dy.cols());
+		for (int j = 0; j < dy.cols(); j++) {
+			for (int i = 0; i < inCount; i++) {
+				size_t bit = static_cast<size_t>(j) * outCount + i;
+				if (mask[bit / 64] >> (bit % 64) & 1) dx[i][j] = dy[i][j] * scale;
+			}
+		}
+		return dx;
+	}
+	void releaseState() override {
+		Layer::releaseState();
+		mask = std::vector<uint64_t>();
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<DropoutLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "Dropout";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the number of neurons, the rate and the seed
+		out.write(reinterpret_cast<const char*>(&inCount), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&rate), sizeof(double));
+		out.write(reinterpret_cast<const char*>(&seed), sizeof(uint64_t));
+	}
+	static std::unique_ptr<DropoutLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the number of neurons, the rate and the seed
+		int count;
+		double rate;
+		uint64_t seed;
+		in.read(reinterpret_cast<char*>(&count), sizeof(int));
+		in.read(reinterpret_cast<char*>(&rate), sizeof(double));
+		in.read(reinterpret_cast<char*>(&seed), sizeof(uint64_t));
+		return std::make_unique<DropoutLayer>(count, rate, seed);
+	}
+private:
+	// Philox key and counter coordinates set by seek()
+	uint32_t key0 = 0, key1 = 0;
+	uint64_t iteration = 0, sample = 0;
+	// One bit per element of the last input, set if the element was kept
+	std::vector<uint64_t> mask;
+};
+
+class EmbeddingLayer : public Layer {
+public:
+	NNMatrix &table = sharedParam(0);
+	int vocabSize, dim;
+	// Maps each of `fields` integer ids in [0, vocabSize) to a trainable row of `dim` values
+	// The output stacks the rows of the fields, so it has fields * dim neurons
+	// Gradients are row-sparse and only cover the ids that were used
+	EmbeddingLayer(int vocabSize, int dim, int fields = 1) : Layer(fields, fields * dim), vocabSize(vocabSize), dim(dim) {
+		table.resize(vocabSize, dim);
+		params = { std::ref(table) };
+		grads.resize(1);
+		grads[0].resize(vocabSize, dim);
+		sparseGrads = true;
+		gradRows.resize(1);
+	}
+
+	NNMatrix run(const NNMatrix& x) override {
+		NNMatrix y(outCount, x.cols());
+		for (int j = 0; j < x.cols(); j++) {
+			for (int f = 0; f < inCount; f++) {
+				const std::vector<double>& row = table[id(x[f][j])];
+				for (int d = 0; d < dim; d++) y[f * dim + d][j] = row[d];
+			}
+		}
+		return y;
+	}
+	NNMatrix forward(const NNMatrix& x) override { lastInput = x; return run(x); }
+	NNMatrix backward(const NNMatrix& dy) override {
+		// Clear the rows set by the last backward propagation
+		std::vector<int>& rows = gradRows[0];
+		for (int r : rows) std::fill(grads[0][r].begin(), grads[0][r].end(), 0.0);
+		rows.clear();
+		// Scatter the output error into the rows of the used ids
+		for (int j = 0; j < dy.cols(); j++) {
+			for (int f = 0; f < inCount; f++) {
+				int r = id(lastInput[f][j]);
+				std::vector<double>& row = grads[0][r];
+				for (int d = 0; d < dim; d++) row[d] += dy[f * dim + d][j];
+				rows.push_back(r);
+			}
+		}
+		std::sort(rows.begin(), rows.end());
+		rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+		// Ids are not differentiable
+		return NNMatrix(inCount, dy.cols());
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<EmbeddingLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "Embedding";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the vocabulary size, embedding dimension and number of fields
+		out.write(reinterpret_cast<const char*>(&vocabSize), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&dim), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&inCount), sizeof(int));
+		// Write the table
+		for (int i = 0; i < table.rows(); i++) {
+			out.write(reinterpret_cast<const char*>(table[i].data()), table.cols() * sizeof(double));
+		}
+	}
+	static std::unique_ptr<EmbeddingLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the vocabulary size, embedding dimension and number of fields
+		int vocabSize, dim, fields;
+		in.read(reinterpret_cast<char*>(&vocabSize), sizeof(int));
+		in.read(reinterpret_cast<char*>(&dim), sizeof(int));
+		in.read(reinterpret_cast<char*>(&fields), sizeof(int));
+		std::unique_ptr<EmbeddingLayer> layer = std::make_unique<EmbeddingLayer>(vocabSize, dim, fields);
+		// Read the table
+		for (int i = 0; i < vocabSize; i++) {
+			in.read(reinterpret_cast<char*>(layer->table[i].data()), dim * sizeof(double));
+		}
+		return layer;
+	}
+private:
+	// Convert an input value to a checked row index
+	int id(double value) const {
+		int r = static_cast<int>(value);
+		if (r < 0 || r >= vocabSize) throw std::runtime_error("Embedding id " + std::to_string(r) + " out of range");
+		return r;
+	}
+};
+
+class HashGridEncodingLayer : public Layer {
+public:
+	// Trainable features of all levels (levels * tableSize x features), level l owns rows [l * tableSize, (l + 1) * tableSize)
+	NNMatrix &table = sharedParam(0);
+	int dims, levels, features, log2TableSize, baseResolution;
+	double growth;
+	// Multiresolution hash encoding (Müller et al., "Instant Neural Graphics Primitives")
+	// Coordinates in [-1, 1] of `dims` (1 to 3) dimensions are looked up in `levels` grids whose resolution grows by `growth`
+	// from `baseResolution`; the features at the corners of the enclosing cell are linearly interpolated and the features
+	// of all levels are stacked (levels * features outputs)
+	// Coarse grids index their table directly, finer grids share a table of 2^log2TableSize entries through a spatial hash
+	// Gradients are row-sparse and only cover the table entries around the input coordinates
+	HashGridEncodingLayer(int dims, int levels = 8, int features = 2, int log2TableSize = 12, int baseResolution = 4, double growth = 1.5) :
+		Layer(dims, levels * features), dims(dims), levels(levels), features(features),
+		log2TableSize(log2TableSize), baseResolution(baseResolution), growth(growth) {
+		if (dims < 1 || dims > 3) throw std::runtime_error("Hash grid encoding supports 1 to 3 dimensions");
+		tableSize = 1 << log2TableSize;
+		for (int l = 0; l < levels; l++) {
+			int resolution = static_cast<int>(std::floor(baseResolution * std::pow(growth, l)));
+			resolutions.push_back(resolution);
+			dense.push_back(std::pow(resolution + 1.0, dims) <= tableSize);
+		}
+		table.resize(levels * tableSize, features);
+		params = { std::ref(table) };
+		grads.resize(1);
+		grads[0].resize(levels * tableSize, features);
+		sparseGrads = true;
+		gradRows.resize(1);
+	}
+
+	NNMatrix run(const NNMatrix& x) override {
+		NNMatrix y(outCount, x.cols());
+		for (int j = 0; j < x.cols(); j++) {
+			for (int l = 0; l < levels; l++) {
+				visitCorners(x, j, l, [this, &y, j, l](int row, double w) {
+					for (int f = 0; f < features; f++) y[l * features + f][j] += w * table[row][f];
+				});
+			}
+		}
+		return y;
+	}
+	NNMatrix forward(const NNMatrix& x) override { lastInput = x; return run(x); }
+	NNMatrix backward(const NNMatrix& dy) override {
+		// Clear the rows set by the last backward propagation
+		std::vector<int>& rows = gradRows[0];
+		for (int r : rows) std::fill(grads[0][r].begin(), grads[0][r].end(), 0.0);
+		rows.clear();
+		// Scatter the output error into the interpolated table entries
+		for (int j = 0; j < dy.cols(); j++) {
+			for (int l = 0; l < levels; l++) {
+				visitCorners(lastInput, j, l, [this, &dy, &rows, j, l](int row, double w) {
+					for (int f = 0; f < features; f++) grads[0][row][f] += w * dy[l * features + f][j];
+					rows.push_back(row);
+				});
+			}
+		}
+		std::sort(rows.begin(), rows.end());
+		rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+		// Coordinates are inputs of the network and not trained
+		return NNMatrix(inCount, dy.cols());
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<HashGridEncodingLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "HashGridEncoding";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the grid options
+		for (int* val : { &dims, &levels, &features, &log2TableSize, &baseResolution }) {
+			out.write(reinterpret_cast<const char*>(val), sizeof(int));
+		}
+		out.write(reinterpret_cast<const char*>(&growth), sizeof(double));
+		// Write the table
+		for (int i = 0; i < table.rows(); i++) {
+			out.write(reinterpret_cast<const char*>(table[i].data()), table.cols() * sizeof(double));
+		}
+	}
+	static std::unique_ptr<HashGridEncodingLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the grid options
+		int dims, levels, features, log2TableSize, baseResolution;
+		double growth;
+		for (int* val : { &dims, &levels, &features, &log2TableSize, &baseResolution }) {
+			in.read(reinterpret_cast<char*>(val), sizeof(int));
+		}
+		in.read(reinterpret_cast<char*>(&growth), sizeof(double));
+		std::unique_ptr<HashGridEncodingLayer> layer = std::make_unique<HashGridEncodingLayer>(dims, levels, features, log2TableSize, baseResolution, growth);
+		// Read the table
+		for (int i = 0; i < layer->table.rows(); i++) {
+			in.read(reinterpret_cast<char*>(layer->table[i].data()), features * sizeof(double));
+		}
+		return layer;
+	}
+private:
+	int tableSize;
+	std::vector<int> resolutions;
+	std::vector<bool> dense;
+
+	// Call func(row, weight) for the table row and interpolation weight of each corner of the cell containing column j of x
+	template<typename Func>
+	void visitCorners(const NNMatrix& x, int j, int l, Func&& func) const {
+		static const uint32_t primes[3] = { 1u, 2654435761u, 805459861u };
+		int resolution = resolutions[l];
+		int cell[3];
+		double frac[3];
+		for (int d = 0; d < dims; d++) {
+			double pos = (std::min(std::max(x[d][j], -1.0), 1.0) + 1) / 2 * resolution;
+			cell[d] = std::min(static_cast<int>(pos), resolution - 1);
+			frac[d] = pos - cell[d];
+		}
+		for (int corner = 0; corner < (1 << dims); corner++) {
+			double w = 1;
+			uint32_t index = 0, hash = 0, stride = 1;
+			for (int d = 0; d < dims; d++) {
+				int bit = (corner >> d) & 1;
+				uint32_t c = cell[d] + bit;
+				w *= bit ? frac[d] : 1 - frac[d];
+				index += c * stride;
+				stride *= resolution + 1;
+				hash ^= c * primes[d];
+			}
+			int row = l * tableSize + static_cast<int>((dense[l] ? index : hash) & (tableSize - 1));
+			func(row, w);
+		}
+	}
+};
+
+// Recurrent layers take a sequence as a matrix with a column per timestep and return either the hidden state
+// of every timestep (returnSequences) or only the final hidden state
+// Training uses truncated backpropagation through time: only the last `bpttSteps` timesteps (0 for all) are
+// stored and backpropagated through, which bounds activation memory regardless of the sequence length
+
+class LSTMLayer : public Layer {
+public:
+	// Gates are stacked in W and B in the order input, forget, cell, output and act on the concatenated [x; h]
+	NNMatrix &W = sharedParam(0), &B = sharedParam(1);
+	int hidden;
+	bool returnSequences;
+	int bpttSteps;
+	LSTMLayer(int in, int hidden, bool returnSequences = false, int bpttSteps = 0) :
+		Layer(in, hidden), hidden(hidden), returnSequences(returnSequences), bpttSteps(bpttSteps) {
+		W.resize(4 * hidden, in + hidden);
+		B.resize(4 * hidden, 1);
+		params = { std::ref(W), std::ref(B) };
+		grads.resize(2);
+		grads[0].resize(4 * hidden, in + hidden);
+		grads[1].resize(4 * hidden, 1);
+	}
+
+	NNMatrix run(const NNMatrix& x) override { return propagate(x, false); }
+	NNMatrix forward(const NNMatrix& x) override { return propagate(x, true); }
+	NNMatrix backward(const NNMatrix& dy) override {
+		int H = hidden, width = inCount + H;
+		grads[0].fill(0);
+		grads[1].fill(0);
+		NNMatrix dx(inCount, lastSteps);
+		std::vector<double> dh(H), dc(H, 0.0), dz(4 * H), dxh(width);
+		std::vector<double> dhNext(H, 0.0);
+		for (int t = lastSteps - 1; t >= lastSteps - stored; t--) {
+			const Step& s = steps[t % steps.size()];
+			for (int k = 0; k < H; k++) {
+				dh[k] = dhNext[k];
+				if (returnSequences) dh[k] += dy[k][t];
+				else if (t == lastSteps - 1) dh[k] += dy[k][0];
+			}
+			// Fused elementwise gate derivatives (Gradients w.r.t. the gate pre-activations)
+			for (int k = 0; k < H; k++) {
+				double i = s.gates[k], f = s.gates[H + k], g = s.gates[2 * H + k], o = s.gates[3 * H + k];
+				double tc = s.tanhC[k];
+				double dcTotal = dc[k] + dh[k] * o * (1 - tc * tc);
+				dz[k] = dcTotal * g * i * (1 - i);
+				dz[H + k] = dcTotal * s.cPrev[k] * f * (1 - f);
+				dz[2 * H + k] = dcTotal * i * (1 - g * g);
+				dz[3 * H + k] = dh[k] * tc * o * (1 - o);
+				dc[k] = dcTotal * f;
+			}
+			accumulateStep(dz, s.xh, dxh);
+			for (int k = 0; k < inCount; k++) dx[k][t] = dxh[k];
+			for (int k = 0; k < H; k++) dhNext[k] = dxh[inCount + k];
+		}
+		return dx;
+	}
+	void releaseState() override {
+		Layer::releaseState();
+		steps = std::vector<Step>();
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<LSTMLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "LSTM";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the number of input and hidden neurons and the sequence options
+		out.write(reinterpret_cast<const char*>(&inCount), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&hidden), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&returnSequences), sizeof(bool));
+		out.write(reinterpret_cast<const char*>(&bpttSteps), sizeof(int));
+		// Write the weights and biases
+		for (NNMatrix& param : params) {
+			param.forEach([&out](double *val, int, int) {
+				out.write(reinterpret_cast<const char*>(val), sizeof(double));
+			});
+		}
+	}
+	static std::unique_ptr<LSTMLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the number of input and hidden neurons and the sequence options
+		int inCount, hidden, bpttSteps;
+		bool returnSequences;
+		in.read(reinterpret_cast<char*>(&inCount), sizeof(int));
+		in.read(reinterpret_cast<char*>(&hidden), sizeof(int));
+		in.read(reinterpret_cast<char*>(&returnSequences), sizeof(bool));
+		in.read(reinterpret_cast<char*>(&bpttSteps), sizeof(int));
+		std::unique_ptr<LSTMLayer> layer = std::make_unique<LSTMLayer>(inCount, hidden, returnSequences, bpttSteps);
+		// Read the weights and biases
+		for (NNMatrix& mat : layer->params) {
+			for (int i = 0; i < mat.rows(); i++) {
+				in.read(reinterpret_cast<char*>(mat[i].data()), mat.cols() * sizeof(double));
+			}
+		}
+		return layer;
+	}
+private:
+	// Activations of a stored timestep: [x; h_prev], activated gates, previous cell state and tanh of the cell state
+	struct Step {
+		std::vector<double> xh, gates, cPrev, tanhC;
+	};
+	// Ring buffer of the last stored timesteps (Timestep t is at t % steps.size())
+	std::vector<Step> steps;
+	int lastSteps = 0, stored = 0;
+
+	NNMatrix propagate(const NNMatrix& x, bool store) {
+		int H = hidden, T = x.cols();
+		NNMatrix y(H, returnSequences ? T : 1);
+		std::vector<double> xh(inCount + H, 0.0), c(H, 0.0), gates(4 * H);
+		if (store) {
+			lastSteps = T;
+			stored = bpttSteps > 0 ? std::min(bpttSteps, T) : T;
+			steps.resize(std::max(stored, 1));
+		}
+		for (int t = 0; t < T; t++) {
+			for (int k = 0; k < inCount; k++) xh[k] = x[k][t];
+			// One concatenated GEMM for all gates: z = W . [x; h] + B
+			for (int r = 0; r < 4 * H; r++) {
+				const std::vector<double>& w = W[r];
+				double z = B[r][0];
+				for (int k = 0; k < inCount + H; k++) z += w[k] * xh[k];
+				gates[r] = r >= 2 * H && r < 3 * H ? std::tanh(z) : 1.0 / (1.0 + std::exp(-z));
+			}
+			bool keep = store && t >= T - stored;
+			if (keep) {
+				Step& s = steps[t % steps.size()];
+				s.xh = xh;
+				s.gates = gates;
+				s.cPrev = c;
+				s.tanhC.resize(H);
+			}
+			// c = f * c + i * g, h = o * tanh(c)
+			for (int k = 0; k < H; k++) {
+				c[k] = gates[H + k] * c[k] + gates[k] * gates[2 * H + k];
+				double tc = std::tanh(c[k]);
+				if (keep) steps[t % steps.size()].tanhC[k] = tc;
+				xh[inCount + k] = gates[3 * H + k] * tc;
+				if (returnSequences) y[k][t] = xh[inCount + k];
+			}
+		}
+		if (!returnSequences) {
+			for (int k = 0; k < H; k++) y[k][0] = xh[inCount + k];
+		}
+		return y;
+	}
+	// Accumulate the parameter gradients of a timestep and set the error of [x; h_prev]
+	void accumulateStep(const std::vector<double>& dz, const std::vector<double>& xh, std::vector<double>& dxh) {
+		std::fill(dxh.begin(), dxh.end(), 0.0);
+		for (int r = 0; r < W.rows(); r++) {
+			const std::vector<double>& w = W[r];
+			std::vector<double>& dw = grads[0][r];
+			double d = dz[r];
+			grads[1][r][0] += d;
+			for (int k = 0; k < W.cols(); k++) {
+				dw[k] += d * xh[k];
+				dxh[k] += w[k] * d;
+			}
+		}
+	}
+};
+
+class GRULayer : public Layer {
+public:
+	// Gates are stacked in W and B in the order reset, update, candidate and act on the concatenated [x; h]
+	// The candidate is n = tanh(W_nx . x + B_n + r * (W_nh . h))
+	NNMatrix &W = sharedParam(0), &B = sharedParam(1);
+	int hidden;
+	bool returnSequences;
+	int bpttSteps;
+	GRULayer(int in, int hidden, bool returnSequences = false, int bpttSteps = 0) :
+		Layer(in, hidden), hidden(hidden), returnSequences(returnSequences), bpttSteps(bpttSteps) {
+		W.resize(3 * hidden, in + hidden);
+		B.resize(3 * hidden, 1);
+		params = { std::ref(W), std::ref(B) };
+		grads.resize(2);
+		grads[0].resize(3 * hidden, in + hidden);
+		grads[1].resize(3 * hidden, 1);
+	}
+
+	NNMatrix run(const NNMatrix& x) override { return propagate(x, false); }
+	NNMatrix forward(const NNMatrix& x) override { return propagate(x, true); }
+	NNMatrix backward(const NNMatrix& dy) override {
+		int H = hidden, width = inCount + H;
+		grads[0].fill(0);
+		grads[1].fill(0);
+		NNMatrix dx(inCount, lastSteps);
+		std::vector<double> dh(H), da(3 * H), dah(H), dxh(width);
+		std::vector<double> dhNext(H, 0.0);
+		for (int t = lastSteps - 1; t >= lastSteps - stored; t--) {
+			const Step& s = steps[t % steps.size()];
+			// Fused elementwise gate derivatives (Gradients w.r.t. the gate pre-activations)
+			for (int k = 0; k < H; k++) {
+				double d = dhNext[k];
+				if (returnSequences) d += dy[k][t];
+				else if (t == lastSteps - 1) d += dy[k][0];
+				double r = s.gates[k], z = s.gates[H + k], n = s.gates[2 * H + k];
+				double hPrev = s.xh[inCount + k];
+				double dn = d * (1 - z) * (1 - n * n);
+				da[k] = dn * s.hn[k] * r * (1 - r);
+				da[H + k] = d * (hPrev - n) * z * (1 - z);
+				da[2 * H + k] = dn;
+				dah[k] = dn * r;
+				dh[k] = d * z;
+			}
+			// Parameter gradients and error of [x; h_prev] (The candidate rows use dah for their recurrent part)
+			std::fill(dxh.begin(), dxh.end(), 0.0);
+			for (int row = 0; row < 3 * H; row++) {
+				const std::vector<double>& w = W[row];
+				std::vector<double>& dw = grads[0][row];
+				grads[1][row][0] += da[row];
+				double dIn = da[row], dRec = row >= 2 * H ? dah[row - 2 * H] : da[row];
+				for (int k = 0; k < inCount; k++) {
+					dw[k] += dIn * s.xh[k];
+					dxh[k] += w[k] * dIn;
+				}
+				for (int k = inCount; k < width; k++) {
+					dw[k] += dRec * s.xh[k];
+					dxh[k] += w[k] * dRec;
+				}
+			}
+			for (int k = 0; k < inCount; k++) dx[k][t] = dxh[k];
+			for (int k = 0; k < H; k++) dhNext[k] = dh[k] + dxh[inCount + k];
+		}
+		return dx;
+	}
+	void releaseState() override {
+		Layer::releaseState();
+		steps = std::vector<Step>();
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<GRULayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "GRU";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the number of input and hidden neurons and the sequence options
+		out.write(reinterpret_cast<const char*>(&inCount), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&hidden), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&returnSequences), sizeof(bool));
+		out.write(reinterpret_cast<const char*>(&bpttSteps), sizeof(int));
+		// Write the weights and biases
+		for (NNMatrix& param : params) {
+			param.forEach([&out](double *val, int, int) {
+				out.write(reinterpret_cast<const char*>(val), sizeof(double));
+			});
+		}
+	}
+	static std::unique_ptr<GRULayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the number of input and hidden neurons and the sequence options
+		int inCount, hidden, bpttSteps;
+		bool returnSequences;
+		in.read(reinterpret_cast<char*>(&inCount), sizeof(int));
+		in.read(reinterpret_cast<char*>(&hidden), sizeof(int));
+		in.read(reinterpret_cast<char*>(&returnSequences), sizeof(bool));
+		in.read(reinterpret_cast<char*>(&bpttSteps), sizeof(int));
+		std::unique_ptr<GRULayer> layer = std::make_unique<GRULayer>(inCount, hidden, returnSequences, bpttSteps);
+		// Read the weights and biases
+		for (NNMatrix& mat : layer->params) {
+			for (int i = 0; i < mat.rows(); i++) {
+				in.read(reinterpret_cast<char*>(mat[i].data()), mat.cols() * sizeof(double));
+			}
+		}
+		return layer;
+	}
+private:
+	// Activations of a stored timestep: [x; h_prev], activated gates and W_nh . h_prev
+	struct Step {
+		std::vector<double> xh, gates, hn;
+	};
+	// Ring buffer of the last stored timesteps (Timestep t is at t % steps.size())
+	std::vector<Step> steps;
+	int lastSteps = 0, stored = 0;
+
+	NNMatrix propagate(const NNMatrix& x, bool store) {
+		int H = hidden, T = x.cols();
+		NNMatrix y(H, returnSequences ? T : 1);
+		std::vector<double> xh(inCount + H, 0.0), gates(3 * H), hn(H);
+		if (store) {
+			lastSteps = T;
+			stored = bpttSteps > 0 ? std::min(bpttSteps, T) : T;
+			steps.resize(std::max(stored, 1));
+		}
+		for (int t = 0; t < T; t++) {
+			for (int k = 0; k < inCount; k++) xh[k] = x[k][t];
+			// One concatenated GEMM for all gates, keeping the recurrent part of the candidate separate
+			for (int r = 0; r < 3 * H; r++) {
+				const std::vector<double>& w = W[r];
+				double zx = B[r][0], zh = 0;
+				for (int k = 0; k < inCount; k++) zx += w[k] * xh[k];
+				for (int k = inCount; k < inCount + H; k++) zh += w[k] * xh[k];
+				if (r < 2 * H) gates[r] = 1.0 / (1.0 + std::exp(-(zx + zh)));
+				else {
+					hn[r - 2 * H] = zh;
+					gates[r] = zx; // Finished below once the reset gate is known
+				}
+			}
+			for (int k = 0; k < H; k++) gates[2 * H + k] = std::tanh(gates[2 * H + k] + gates[k] * hn[k]);
+			if (store && t >= T - stored) {
+				Step& s = steps[t % steps.size()];
+				s.xh = xh;
+				s.gates = gates;
+				s.hn = hn;
+			}
+			// h = (1 - z) * n + z * h
+			for (int k = 0; k < H; k++) {
+				double z = gates[H + k];
+				xh[inCount + k] = (1 - z) * gates[2 * H + k] + z * xh[inCount + k];
+				if (returnSequences) y[k][t] = xh[inCount + k];
+			}
+		}
+		if (!returnSequences) {
+			for (int k = 0; k < H; k++) y[k][0] = xh[inCount + k];
+		}
+		return y;
+	}
+};
+
+// Key and value cache of an attention layer for incremental inference
+// Keys and values of `capacity` tokens are kept in preallocated ring buffers; once full, appending evicts the oldest token
+struct NNAttentionCache {
+	int capacity = 0, dim = 0;
+	// Ring position of the oldest cached token and the number of cached tokens
+	int start = 0, length = 0;
+	std::vector<double> keys, values;
+	NNAttentionCache(int capacity = 0, int dim = 0) : capacity(capacity), dim(dim),
+		keys(static_cast<size_t>(capacity) * dim), values(static_cast<size_t>(capacity) * dim) {}
+
+	// Ring position of the i-th oldest cached token
+	int slot(int i) const { return (start + i) % capacity; }
+	// Append the key and value of a token, evicting the oldest token if the cache is full
+	void append(const double* key, const double* value) {
+		if (capacity <= 0) throw std::runtime_error("Cannot append to a cache without capacity");
+		if (length == capacity) evict(1);
+		int s = slot(length);
+		std::copy(key, key + dim, keys.begin() + static_cast<size_t>(s) * dim);
+		std::copy(value, value + dim, values.begin() + static_cast<size_t>(s) * dim);
+		length++;
+	}
+	// Drop the `count` oldest tokens
+	void evict(int count) {
+		count = std::min(std::max(count, 0), length);
+		if (length > count) start = (start + count) % capacity;
+		else start = 0;
+		length -= count;
+	}
+	// Drop the newest tokens until `newLength` tokens are left
+	void truncate(int newLength) {
+		length = std::min(std::max(newLength, 0), length);
+		if (length == 0) start = 0;
+	}
+	void clear() { start = length = 0; }
+};
+
+class MultiHeadAttentionLayer : public Layer {
+public:
+	// Wqkv stacks the query, key and value projections so they are computed with a single GEMM
+	NNMatrix &Wqkv = sharedParam(0), &Bqkv = sharedParam(1), &Wo = sharedParam(2), &Bo = sharedParam(3);
+	int heads, headDim;
+	bool causal;
+	// Number of queries and keys per tile of the attention kernel
+	int tileSize = 32;
+	// Self-attention over a sequence given as a matrix with a column per token of `dModel` features
+	// softmax(Q . K^T / sqrt(headDim)) . V is computed in tiles with an online softmax, so the tokens x tokens
+	// score matrix is never stored; backward recomputes the score tiles from the per-query log-sum-exp
+	// If `causal` is set, each token only attends to itself and earlier tokens
+	MultiHeadAttentionLayer(int dModel, int heads, bool causal = false) :
+		Layer(dModel, dModel), heads(heads), headDim(heads > 0 ? dModel / heads : 0), causal(causal) {
+		if (heads <= 0 || dModel % heads != 0) throw std::runtime_error("Model size " + std::to_string(dModel) + " is not divisible into " + std::to_string(heads) + " heads");
+		Wqkv.resize(3 * dModel, dModel);
+		Bqkv.resize(3 * dModel, 1);
+		Wo.resize(dModel, dModel);
+		Bo.resize(dModel, 1);
+		params = { std::ref(Wqkv), std::ref(Bqkv), std::ref(Wo), std::ref(Bo) };
+		grads.resize(4);
+		grads[0].resize(3 * dModel, dModel);
+		grads[1].resize(3 * dModel, 1);
+		grads[2].resize(dModel, dModel);
+		grads[3].resize(dModel, 1);
+	}
+
+	NNMatrix run(const NNMatrix& x) override {
+		std::vector<double> q, k, v, o, lse;
+		project(x, q, k, v);
+		attend(x.cols(), q, k, v, o, lse);
+		return output(o, x.cols());
+	}
+	// Run a single token (dModel x 1) attending to itself and the tokens in the cache, then append it to the cache
+	// Only the new token is projected, so the cost per token is independent of how many tokens came before
+	NNMatrix step(const NNMatrix& x, NNAttentionCache& cache) const {
+		if (!causal) throw std::runtime_error("Incremental stepping requires a causal attention layer");
+		if (x.rows() != inCount || x.cols() != 1) throw std::runtime_error("Attention step expects a single token");
+		if (cache.dim != inCount) throw std::runtime_error("Attention cache does not match the layer");
+		int d = inCount;
+		std::vector<double> qkv(3 * d);
+		for (int r = 0; r < 3 * d; r++) {
+			const std::vector<double>& w = Wqkv[r];
+			double sum = Bqkv[r][0];
+			for (int c = 0; c < d; c++) sum += w[c] * x[c][0];
+			qkv[r] = sum;
+		}
+		cache.append(&qkv[d], &qkv[2 * d]);
+		// Online softmax over the cached tokens of each head
+		double scale = 1.0 / std::sqrt(headDim);
+		std::vector<double> o(d, 0.0);
+		for (int h = 0; h < heads; h++) {
+			int off = h * headDim;
+			double m = -INFINITY, l = 0;
+			for (int i = 0; i < cache.length; i++) {
+				size_t s = static_cast<size_t>(cache.slot(i)) * d + off;
+				double score = 0;
+				for (int c = 0; c < headDim; c++) score += qkv[off + c] * cache.keys[s + c];
+				score *= scale;
+				double mNew = std::max(m, score);
+				double correction = std::exp(m - mNew), p = std::exp(score - mNew);
+				l = l * correction + p;
+				for (int c = 0; c < headDim; c++) o[off + c] = o[off + c] * correction + p * cache.values[s + c];
+				m = mNew;
+			}
+			for (int c = 0; c < headDim; c++) o[off + c] /= l;
+		}
+		return output(o, 1);
+	}
+	NNMatrix forward(const NNMatrix& x) override {
+		lastInput = x;
+		project(x, lastQ, lastK, lastV);
+		attend(x.cols(), lastQ, lastK, lastV, lastO, lastLse);
+		return output(lastO, x.cols());
+	}
+	NNMatrix backward(const NNMatrix& dy) override {
+		int d = inCount, T = dy.cols();
+		// Output projection: y = Wo . o + Bo
+		NNMatrix o(d, T);
+		for (int t = 0; t < T; t++) {
+			for (int c = 0; c < d; c++) o[c][t] = lastO[t * d + c];
+		}
+		grads[2] = NNMatrix::dot(dy, o.transpose());
+		grads[3] = dy.rowSum();
+		NNMatrix dOut = NNMatrix::dot(Wo.transpose(), dy);
+		std::vector<double> dO(static_cast<size_t>(T) * d);
+		for (int t = 0; t < T; t++) {
+			for (int c = 0; c < d; c++) dO[t * d + c] = dOut[c][t];
+		}
+		// Attention: recompute each score tile and accumulate dQ, dK and dV
+		std::vector<double> dq(dO.size(), 0.0), dk(dO.size(), 0.0), dv(dO.size(), 0.0);
+		std::vector<double> D(T);
+		double scale = 1.0 / std::sqrt(headDim);
+		for (int h = 0; h < heads; h++) {
+			int off = h * headDim;
+			// D_i = dO_i . O_i
+			for (int i = 0; i < T; i++) {
+				double sum = 0;
+				for (int c = 0; c < headDim; c++) sum += dO[i * d + off + c] * lastO[i * d + off + c];
+				D[i] = sum;
+			}
+			for (int j0 = 0; j0 < T; j0 += tileSize) {
+				int j1 = std::min(j0 + tileSize, T);
+				for (int i = causal ? j0 : 0; i < T; i++) {
+					const double* qi = &lastQ[i * d + off];
+					const double* doi = &dO[i * d + off];
+					double* dqi = &dq[i * d + off];
+					double lse = lastLse[i * heads + h];
+					int jEnd = causal ? std::min(j1, i + 1) : j1;
+					for (int j = j0; j < jEnd; j++) {
+						const double* kj = &lastK[j * d + off];
+						const double* vj = &lastV[j * d + off];
+						double s = 0, dp = 0;
+						for (int c = 0; c < headDim; c++) {
+							s += qi[c] * kj[c];
+							dp += doi[c] * vj[c];
+						}
+						double p = std::exp(s * scale - lse);
+						double ds = p * (dp - D[i]) * scale;
+						double* dkj = &dk[j * d + off];
+						double* dvj = &dv[j * d + off];
+						for (int c = 0; c < headDim; c++) {
+							dvj[c] += p * doi[c];
+							dqi[c] += ds * kj[c];
+							dkj[c] += ds * qi[c];
+						}
+					}
+				}
+			}
+		}
+		// Input projection: [q; k; v] = Wqkv . x + Bqkv
+		NNMatrix dqkv(3 * d, T);
+		for (int t = 0; t < T; t++) {
+			for (int c = 0; c < d; c++) {
+				dqkv[c][t] = dq[t * d + c];
+				dqkv[d + c][t] = dk[t * d + c];
+				dqkv[2 * d + c][t] = dv[t * d + c];
+			}
+		}
+		grads[0] = NNMatrix::dot(dqkv, lastInput.transpose());
+		grads[1] = dqkv.rowSum();
+		return NNMatrix::dot(Wqkv.transpose(), dqkv);
+	}
+	void releaseState() override {
+		Layer::releaseState();
+		for (std::vector<double>* buffer : { &lastQ, &lastK, &lastV, &lastO, &lastLse }) *buffer = std::vector<double>();
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<MultiHeadAttentionLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "MultiHeadAttention";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the model size, number of heads and masking
+		out.write(reinterpret_cast<const char*>(&inCount), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&heads), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&causal), sizeof(bool));
+		// Write the projections
+		for (NNMatrix& param : params) {
+			param.forEach([&out](double *val, int, int) {
+				out.write(reinterpret_cast<const char*>(val), sizeof(double));
+			});
+		}
+	}
+	static std::unique_ptr<MultiHeadAttentionLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the model size, number of heads and masking
+		int dModel, heads;
+		bool causal;
+		in.read(reinterpret_cast<char*>(&dModel), sizeof(int));
+		in.read(reinterpret_cast<char*>(&heads), sizeof(int));
+		in.read(reinterpret_cast<char*>(&causal), sizeof(bool));
+		std::unique_ptr<MultiHeadAttentionLayer> layer = std::make_unique<MultiHeadAttentionLayer>(dModel, heads, causal);
+		// Read the projections
+		for (NNMatrix& mat : layer->params) {
+			for (int i = 0; i < mat.rows(); i++) {
+				in.read(reinterpret_cast<char*>(mat[i].data()), mat.cols() * sizeof(double));
+			}
+		}
+		return layer;
+	}
+private:
+	// Token-major (tokens x dModel) queries, keys, values and attention outputs and the
+	// per-query (tokens x heads) log-sum-exp of the scores of the last forward propagation
+	std::vector<double> lastQ, lastK, lastV, lastO, lastLse;
+
+	// Compute the queries, keys and values in token-major order with one GEMM
+	void project(const NNMatrix& x, std::vector<double>& q, std::vector<double>& k, std::vector<double>& v) const {
+		int d = inCount, T = x.cols();
+		NNMatrix qkv = NNMatrix::dot(Wqkv, x);
+		qkv.addToColumns(Bqkv);
+		q.resize(static_cast<size_t>(T) * d);
+		k.resize(q.size());
+		v.resize(q.size());
+		for (int t = 0; t < T; t++) {
+			for (int c = 0; c < d; c++) {
+				q[t * d + c] = qkv[c][t];
+				k[t * d + c] = qkv[d + c][t];
+				v[t * d + c] = qkv[2 * d + c][t];
+			}
+		}
+	}
+	// Tiled attention with an online softmax
+	// For each query the running maximum m, normalizer l and weighted value sum are rescaled as new key tiles arrive
+	void attend(int T, const std::vector<double>& q, const std::vector<double>& k, const std::vector<double>& v,
+		std::vector<double>& o, std::vector<double>& lse) const {
+		int d = inCount;
+		double scale = 1.0 / std::sqrt(headDim);
+		o.assign(static_cast<size_t>(T) * d, 0.0);
+		lse.resize(static_cast<size_t>(T) * heads);
+		std::vector<double> m(tileSize), l(tileSize), scores(tileSize);
+		for (int h = 0; h < heads; h++) {
+			int off = h * headDim;
+			for (int i0 = 0; i0 < T; i0 += tileSize) {
+				int i1 = std::min(i0 + tileSize, T);
+				std::fill(m.begin(), m.end(), -INFINITY);
+				std::fill(l.begin(), l.end(), 0.0);
+				int jLast = causal ? i1 : T;
+				for (int j0 = 0; j0 < jLast; j0 += tileSize) {
+					int j1 = std::min(j0 + tileSize, jLast);
+					for (int i = i0; i < i1; i++) {
+						const double* qi = &q[i * d + off];
+						double* oi = &o[i * d + off];
+						int jEnd = causal ? std::min(j1, i + 1) : j1;
+						if (jEnd <= j0) continue;
+						double tileMax = -INFINITY;
+						for (int j = j0; j < jEnd; j++) {
+							const double* kj = &k[j * d + off];
+							double s = 0;
+							for (int c = 0; c < headDim; c++) s += qi[c] * kj[c];
+							scores[j - j0] = s * scale;
+							tileMax = std::max(tileMax, scores[j - j0]);
+						}
+						double mNew = std::max(m[i - i0], tileMax);
+						double correction = std::exp(m[i - i0] - mNew);
+						l[i - i0] *= correction;
+						for (int c = 0; c < headDim; c++) oi[c] *= correction;
+						for (int j = j0; j < jEnd; j++) {
+							double p = std::exp(scores[j - j0] - mNew);
+							l[i - i0] += p;
+							const double* vj = &v[j * d + off];
+							for (int c = 0; c < headDim; c++) oi[c] += p * vj[c];
+						}
+						m[i - i0] = mNew;
+					}
+				}
+				for (int i = i0; i < i1; i++) {
+					for (int c = 0; c < headDim; c++) o[i * d + off + c] /= l[i - i0];
+					lse[i * heads + h] = m[i - i0] + std::log(l[i - i0]);
+				}
+			}
+		}
+	}
+	// Apply the output projection to token-major attention outputs
+	NNMatrix output(const std::vector<double>& o, int T) const {
+		int d = inCount;
+		NNMatrix y(d, T);
+		for (int r = 0; r < d; r++) {
+			const std::vector<double>& w = Wo[r];
+			for (int t = 0; t < T; t++) {
+				const double* ot = &o[t * d];
+				double sum = Bo[r][0];
+				for (int c = 0; c < d; c++) sum += w[c] * ot[c];
+				y[r][t] = sum;
+			}
+		}
+		return y;
+	}
+};
+
+// Pooling layers take a flattened column of `channels` feature maps of `height` x `width`
+// Element (c, y, x) of the input is at row c * height * width + y * width + x
+
+class MaxPool2DLayer : public Layer {
+public:
+	int channels, height, width, size, stride, outHeight, outWidth;
+	// Flat input index of the maximum of each pooling window (outCount x columns of the last input)
+	std::vector<int> argmax;
+	MaxPool2DLayer(int channels, int height, int width, int size, int stride = 0) :
+		channels(channels), height(height), width(width), size(size), stride(stride > 0 ? stride : size) {
+		if (size <= 0 || size > height || size > width) throw std::runtime_error("Invalid pooling size " + std::to_string(size));
+		outHeight = (height - size) / this->stride + 1;
+		outWidth = (width - size) / this->stride + 1;
+		inCount = channels * height * width;
+		outCount = channels * outHeight * outWidth;
+	}
+
+	NNMatrix run(const NNMatrix& x) override { return pool(x, nullptr); }
+	NNMatrix forward(const NNMatrix& x) override {
+		argmax.resize(outCount * x.cols());
+		return pool(x, argmax.data());
+	}
+	NNMatrix backward(const NNMatrix& dy) override {
+		// Scatter each output error to the input that was the maximum of its window
+		NNMatrix dx(inCount, dy.cols());
+		for (int j = 0; j < dy.cols(); j++) {
+			const int* idx = argmax.data() + outCount * j;
+			for (int o = 0; o < outCount; o++) dx[idx[o]][j] += dy[o][j];
+		}
+		return dx;
+	}
+	void releaseState() override {
+		Layer::releaseState();
+		argmax = std::vector<int>();
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<MaxPool2DLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "MaxPool2D";
+		uint32_t typeSize = type.size();
+		out.write(reinterpret_cast<const char*>(&typeSize), sizeof(uint32_t));
+		out.write(type.c_str(), typeSize);
+		// Write the input shape and pooling window
+		out.write(reinterpret_cast<const char*>(&channels), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&height), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&width), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&size), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&stride), sizeof(int));
+	}
+	static std::unique_ptr<MaxPool2DLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the input shape and pooling window
+		int channels, height, width, size, stride;
+		in.read(reinterpret_cast<char*>(&channels), sizeof(int));
+		in.read(reinterpret_cast<char*>(&height), sizeof(int));
+		in.read(reinterpret_cast<char*>(&width), sizeof(int));
+		in.read(reinterpret_cast<char*>(&size), sizeof(int));
+		in.read(reinterpret_cast<char*>(&stride), sizeof(int));
+		return std::make_unique<MaxPool2DLayer>(channels, height, width, size, stride);
+	}
+private:
+	// Max pool every column of x, optionally recording the flat input index of each maximum
+	NNMatrix pool(const NNMatrix& x, int* idx) const {
+		NNMatrix y(outCount, x.cols());
+		for (int j = 0; j < x.cols(); j++) {
+			int o = 0;
+			for (int c = 0; c < channels; c++) {
+				for (int oy = 0; oy < outHeight; oy++) {
+					for (int ox = 0; ox < outWidth; ox++, o++) {
+						int best = c * height * width + oy * stride * width + ox * stride;
+						for (int ky = 0; ky < size; ky++) {
+							int row = c * height * width + (oy * stride + ky) * width + ox * stride;
+							for (int kx = 0; kx < size; kx++) {
+								if (x[row + kx][j] > x[best][j]) best = row + kx;
+							}
+						}
+						y[o][j] = x[best][j];
+						if (idx != nullptr) idx[outCount * j + o] = best;
+					}
+				}
+			}
+		}
+		return y;
+	}
+};
+
+class AvgPool2DLayer : public Layer {
+public:
+	int channels, height, width, size, stride, outHeight, outWidth;
+	AvgPool2DLayer(int channels, int height, int width, int size, int stride = 0) :
+		channels(channels), height(height), width(width), size(size), stride(stride > 0 ? stride : size) {
+		if (size <= 0 || size > height || size > width) throw std::runtime_error("Invalid pooling size " + std::to_string(size));
+		outHeight = (height - size) / this->stride + 1;
+		outWidth = (width - size) / this->stride + 1;
+		inCount = channels * height * width;
+		outCount = channels * outHeight * outWidth;
+	}
+
+	NNMatrix run(const NNMatrix& x) override {
+		NNMatrix y(outCount, x.cols());
+		double scale = 1.0 / (size * size);
+		for (int j = 0; j < x.cols(); j++) {
+			int o = 0;
+			for (int c = 0; c < channels; c++) {
+				for (int oy = 0; oy < outHeight; oy++) {
+					for (int ox = 0; ox < outWidth; ox++, o++) {
+						double sum = 0;
+						for (int ky = 0; ky < size; ky++) {
+							int row = c * height * width + (oy * stride + ky) * width + ox * stride;
+							for (int kx = 0; kx < size; kx++) sum += x[row + kx][j];
+						}
+						y[o][j] = sum * scale;
+					}
+				}
+			}
+		}
+		return y;
+	}
+	// Average pooling is linear, so backward only needs the shape and nothing from the input
+	NNMatrix forward(const NNMatrix& x) override { return run(x); }
+	NNMatrix backward(const NNMatrix& dy) override {
+		// Spread each output error evenly across its window
+		NNMatrix dx(inCount, dy.cols());
+		double scale = 1.0 / (size * size);
+		for (int j = 0; j < dy.cols(); j++) {
+			int o = 0;
+			for (int c = 0; c < channels; c++) {
+				for (int oy = 0; oy < outHeight; oy++) {
+					for (int ox = 0; ox < outWidth; ox++, o++) {
+						double d = dy[o][j] * scale;
+						for (int ky = 0; ky < size; ky++) {
+							int row = c * height * width + (oy * stride + ky) * width + ox * stride;
+							for (int kx = 0; kx < size; kx++) dx[row + kx][j] += d;
+						}
+					}
+				}
+			}
+		}
+		return dx;
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<AvgPool2DLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "AvgPool2D";
+		uint32_t typeSize = type.size();
+		out.write(reinterpret_cast<const char*>(&typeSize), sizeof(uint32_t));
+		out.write(type.c_str(), typeSize);
+		// Write the input shape and pooling window
+		out.write(reinterpret_cast<const char*>(&channels), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&height), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&width), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&size), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&stride), sizeof(int));
+	}
+	static std::unique_ptr<AvgPool2DLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the input shape and pooling window
+		int channels, height, width, size, stride;
+		in.read(reinterpret_cast<char*>(&channels), sizeof(int));
+		in.read(reinterpret_cast<char*>(&height), sizeof(int));
+		in.read(reinterpret_cast<char*>(&width), sizeof(int));
+		in.read(reinterpret_cast<char*>(&size), sizeof(int));
+		in.read(reinterpret_cast<char*>(&stride), sizeof(int));
+		return std::make_unique<AvgPool2DLayer>(channels, height, width, size, stride);
+	}
+};
+
+class GlobalAvgPoolLayer : public Layer {
+public:
+	int channels, area;
+	// Averages each of the `channels` feature maps of `area` elements into a single value
+	GlobalAvgPoolLayer(int channels, int area) : Layer(channels * area, channels), channels(channels), area(area) {}
+
+	NNMatrix run(const NNMatrix& x) override {
+		NNMatrix y(channels, x.cols());
+		for (int j = 0; j < x.cols(); j++) {
+			for (int c = 0; c < channels; c++) {
+				double sum = 0;
+				for (int k = 0; k < area; k++) sum += x[c * area + k][j];
+				y[c][j] = sum / area;
+			}
+		}
+		return y;
+	}
+	NNMatrix forward(const NNMatrix& x) override { return run(x); }
+	NNMatrix backward(const NNMatrix& dy) override {
+		NNMatrix dx(inCount, dy.cols());
+		for (int j = 0; j < dy.cols(); j++) {
+			for (int c = 0; c < channels; c++) {
+				double d = dy[c][j] / area;
+				for (int k = 0; k < area; k++) dx[c * area + k][j] = d;
+			}
+		}
+		return dx;
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<GlobalAvgPoolLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "GlobalAvgPool";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the number of channels and the area of each channel
+		out.write(reinterpret_cast<const char*>(&channels), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&area), sizeof(int));
+	}
+	static std::unique_ptr<GlobalAvgPoolLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the number of channels and the area of each channel
+		int channels, area;
+		in.read(reinterpret_cast<char*>(&channels), sizeof(int));
+		in.read(reinterpret_cast<char*>(&area), sizeof(int));
+		return std::make_unique<GlobalAvgPoolLayer>(channels, area);
+	}
+};
+
+// Convolution layers take a flattened column of `channels` feature maps in the same layout as the pooling layers
+
+class DepthwiseConv2DLayer : public Layer {
+public:
+	// W holds one kernel of size x size per channel (row-major) and B one bias per channel
+	NNMatrix &W = sharedParam(0), &B = sharedParam(1);
+	int channels, height, width, size, stride, padding, outHeight, outWidth;
+	// Convolves every channel with its own kernel (No mixing between channels)
+	DepthwiseConv2DLayer(int channels, int height, int width, int size, int stride = 1, int padding = 0) :
+		channels(channels), height(height), width(width), size(size), stride(stride), padding(padding) {
+		if (size <= 0 || stride <= 0 || padding < 0 || size > height + 2 * padding || size > width + 2 * padding) {
+			throw std::runtime_error("Invalid depthwise convolution of size " + std::to_string(size));
+		}
+		outHeight = (height + 2 * padding - size) / stride + 1;
+		outWidth = (width + 2 * padding - size) / stride + 1;
+		inCount = channels * height * width;
+		outCount = channels * outHeight * outWidth;
+		W.resize(channels, size * size);
+		B.resize(channels, 1);
+		params = { std::ref(W), std::ref(B) };
+		grads.resize(2);
+		grads[0].resize(channels, size * size);
+		grads[1].resize(channels, 1);
+	}
+
+	NNMatrix run(const NNMatrix& x) override {
+		NNMatrix y(outCount, x.cols());
+		std::vector<double> in, out(outHeight * outWidth);
+		for (int j = 0; j < x.cols(); j++) {
+			for (int c = 0; c < channels; c++) {
+				loadPlane(x, j, c, in);
+				// Accumulate one kernel tap at a time over whole output rows, which the compiler can vectorize
+				std::fill(out.begin(), out.end(), B[c][0]);
+				int paddedWidth = width + 2 * padding;
+				for (int oy = 0; oy < outHeight; oy++) {
+					double* dst = &out[oy * outWidth];
+					for (int ky = 0; ky < size; ky++) {
+						const double* src = &in[(oy * stride + ky) * paddedWidth];
+						for (int kx = 0; kx < size; kx++) {
+							double w = W[c][ky * size + kx];
+							const double* s = src + kx;
+							for (int ox = 0; ox < outWidth; ox++) dst[ox] += w * s[ox * stride];
+						}
+					}
+				}
+				for (int p = 0; p < outHeight * outWidth; p++) y[c * outHeight * outWidth + p][j] = out[p];
+			}
+		}
+		return y;
+	}
+	NNMatrix forward(const NNMatrix& x) override { lastInput = x; return run(x); }
+	NNMatrix backward(const NNMatrix& dy) override {
+		grads[0].fill(0);
+		grads[1].fill(0);
+		NNMatrix dx(inCount, dy.cols());
+		int paddedWidth = width + 2 * padding;
+		std::vector<double> in, dIn, d(outHeight * outWidth);
+		for (int j = 0; j < dy.cols(); j++) {
+			for (int c = 0; c < channels; c++) {
+				loadPlane(lastInput, j, c, in);
+				dIn.assign(in.size(), 0.0);
+				for (int p = 0; p < outHeight * outWidth; p++) {
+					d[p] = dy[c * outHeight * outWidth + p][j];
+					grads[1][c][0] += d[p];
+				}
+				for (int oy = 0; oy < outHeight; oy++) {
+					const double* g = &d[oy * outWidth];
+					for (int ky = 0; ky < size; ky++) {
+						int row = (oy * stride + ky) * paddedWidth;
+						for (int kx = 0; kx < size; kx++) {
+							double w = W[c][ky * size + kx], dw = 0;
+							const double* s = &in[row + kx];
+							double* ds = &dIn[row + kx];
+							for (int ox = 0; ox < outWidth; ox++) {
+								dw += g[ox] * s[ox * stride];
+								ds[ox * stride] += w * g[ox];
+							}
+							grads[0][c][ky * size + kx] += dw;
+						}
+					}
+				}
+				// Drop the padding
+				for (int iy = 0; iy < height; iy++) {
+					for (int ix = 0; ix < width; ix++) {
+						dx[c * height * width + iy * width + ix][j] = dIn[(iy + padding) * paddedWidth + ix + padding];
+					}
+				}
+			}
+		}
+		return dx;
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<DepthwiseConv2DLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "DepthwiseConv2D";
+		uint32_t typeSize = type.size();
+		out.write(reinterpret_cast<const char*>(&typeSize), sizeof(uint32_t));
+		out.write(type.c_str(), typeSize);
+		// Write the input shape and kernel options
+		for (int* val : { &channels, &height, &width, &size, &stride, &padding }) {
+			out.write(reinterpret_cast<const char*>(val), sizeof(int));
+		}
+		// Write the kernels and biases
+		for (NNMatrix& param : params) {
+			param.forEach([&out](double *val, int, int) {
+				out.write(reinterpret_cast<const char*>(val), sizeof(double));
+			});
+		}
+	}
+	static std::unique_ptr<DepthwiseConv2DLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the input shape and kernel options
+		int channels, height, width, size, stride, padding;
+		for (int* val : { &channels, &height, &width, &size, &stride, &padding }) {
+			in.read(reinterpret_cast<char*>(val), sizeof(int));
+		}
+		std::unique_ptr<DepthwiseConv2DLayer> layer = std::make_unique<DepthwiseConv2DLayer>(channels, height, width, size, stride, padding);
+		// Read the kernels and biases
+		for (NNMatrix& mat : layer->params) {
+			for (int i = 0; i < mat.rows(); i++) {
+				in.read(reinterpret_cast<char*>(mat[i].data()), mat.cols() * sizeof(double));
+			}
+		}
+		return layer;
+	}
+private:
+	// Copy channel c of column j into a contiguous zero-padded plane
+	void loadPlane(const NNMatrix& x, int j, int c, std::vector<double>& plane) const {
+		int paddedWidth = width + 2 * padding;
+		plane.assign((height + 2 * padding) * paddedWidth, 0.0);
+		for (int iy = 0; iy < height; iy++) {
+			for (int ix = 0; ix < width; ix++) {
+				plane[(iy + padding) * paddedWidth + ix + padding] = x[c * height * width + iy * width + ix][j];
+			}
+		}
+	}
+};
+
+class PointwiseConv2DLayer : public Layer {
+public:
+	// W mixes the channels at every position (outChannels x inChannels) and B holds one bias per output channel
+	NNMatrix &W = sharedParam(0), &B = sharedParam(1);
+	int inChannels, outChannels, area;
+	// 1x1 convolution over feature maps of `area` positions
+	// Row c * area + p holds channel c at position p for every sample, so the rows are read in place without unfolding
+	PointwiseConv2DLayer(int inChannels, int outChannels, int area) :
+		Layer(inChannels * area, outChannels * area), inChannels(inChannels), outChannels(outChannels), area(area) {
+		W.resize(outChannels, inChannels);
+		B.resize(outChannels, 1);
+		params = { std::ref(W), std::ref(B) };
+		grads.resize(2);
+		grads[0].resize(outChannels, inChannels);
+		grads[1].resize(outChannels, 1);
+	}
+
+	NNMatrix run(const NNMatrix& x) override {
+		int n = x.cols();
+		NNMatrix y(outCount, n);
+		for (int o = 0; o < outChannels; o++) {
+			// Y = W . X + B
+			for (int c = 0; c < inChannels; c++) {
+				double w = W[o][c];
+				for (int p = 0; p < area; p++) {
+					const double* in = x[c * area + p].data();
+					double* out = y[o * area + p].data();
+					for (int j = 0; j < n; j++) out[j] += w * in[j];
+				}
+			}
+			for (int p = 0; p < area; p++) {
+				double* out = y[o * area + p].data();
+				for (int j = 0; j < n; j++) out[j] += B[o][0];
+			}
+		}
+		return y;
+	}
+	NNMatrix forward(const NNMatrix& x) override { lastInput = x; return run(x); }
+	NNMatrix backward(const NNMatrix& dy) override {
+		int n = dy.cols();
+		grads[0].fill(0);
+		grads[1].fill(0);
+		NNMatrix dx(inCount, n);
+		// Sums over the positions of every sample
+		std::vector<double> sums(n);
+		for (int o = 0; o < outChannels; o++) {
+			// dW = dY . X^T
+			for (int c = 0; c < inChannels; c++) {
+				std::fill(sums.begin(), sums.end(), 0.0);
+				for (int p = 0; p < area; p++) {
+					const double* d = dy[o * area + p].data();
+					const double* in = lastInput[c * area + p].data();
+					for (int j = 0; j < n; j++) sums[j] += d[j] * in[j];
+				}
+				for (int j = 0; j < n; j++) grads[0][o][c] += sums[j];
+			}
+			// dB = dY (summed over positions)
+			std::fill(sums.begin(), sums.end(), 0.0);
+			for (int p = 0; p < area; p++) {
+				const double* d = dy[o * area + p].data();
+				for (int j = 0; j < n; j++) sums[j] += d[j];
+			}
+			for (int j = 0; j < n; j++) grads[1][o][0] += sums[j];
+		}
+		// dX = W^T . dY
+		for (int c = 0; c < inChannels; c++) {
+			for (int o = 0; o < outChannels; o++) {
+				double w = W[o][c];
+				for (int p = 0; p < area; p++) {
+					const double* d = dy[o * area + p].data();
+					double* out = dx[c * area + p].data();
+					for (int j = 0; j < n; j++) out[j] += w * d[j];
+				}
+			}
+		}
+		return dx;
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<PointwiseConv2DLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "PointwiseConv2D";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the number of channels and the area
+		out.write(reinterpret_cast<const char*>(&inChannels), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&outChannels), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&area), sizeof(int));
+		// Write the weights and biases
+		for (NNMatrix& param : params) {
+			param.forEach([&out](double *val, int, int) {
+				out.write(reinterpret_cast<const char*>(val), sizeof(double));
+			});
+		}
+	}
+	static std::unique_ptr<PointwiseConv2DLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the number of channels and the area
+		int inChannels, outChannels, area;
+		in.read(reinterpret_cast<char*>(&inChannels), sizeof(int));
+		in.read(reinterpret_cast<char*>(&outChannels), sizeof(int));
+		in.read(reinterpret_cast<char*>(&area), sizeof(int));
+		std::unique_ptr<PointwiseConv2DLayer> layer = std::make_unique<PointwiseConv2DLayer>(inChannels, outChannels, area);
+		// Read the weights and biases
+		for (NNMatrix& mat : layer->params) {
+			for (int i = 0; i < mat.rows(); i++) {
+				in.read(reinterpret_cast<char*>(mat[i].data()), mat.cols() * sizeof(double));
+			}
+		}
+		return layer;
+	}
+};
+
+// Merge layers combine several tensors of a graph network (See NeuralNetwork::addNode)
+// The network stacks the rows of all inputs of a node into a single matrix, so merge layers take the stacked inputs
+
+class AddLayer : public Layer {
+public:
+	int inputs;
+	// Element-wise sum of `inputs` tensors of `count` neurons each (e.g. residual connections)
+	AddLayer(int count, int inputs = 2) : Layer(count * inputs, count), inputs(inputs) {}
+
+	NNMatrix run(const NNMatrix& x) override {
+		NNMatrix y(outCount, x.cols());
+		for (int k = 0; k < inputs; k++) {
+			for (int i = 0; i < outCount; i++) {
+				const std::vector<double>& row = x[k * outCount + i];
+				for (int j = 0; j < x.cols(); j++) y[i][j] += row[j];
+			}
+		}
+		return y;
+	}
+	NNMatrix forward(const NNMatrix& x) override { return run(x); }
+	NNMatrix backward(const NNMatrix& dy) override {
+		// Every input receives the full output error
+		NNMatrix dx(inCount, dy.cols());
+		for (int k = 0; k < inputs; k++) {
+			for (int i = 0; i < outCount; i++) dx[k * outCount + i] = dy[i];
+		}
+		return dx;
+	}
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<AddLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "Add";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the number of neurons and inputs
+		out.write(reinterpret_cast<const char*>(&outCount), sizeof(int));
+		out.write(reinterpret_cast<const char*>(&inputs), sizeof(int));
+	}
+	static std::unique_ptr<AddLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the number of neurons and inputs
+		int count, inputs;
+		in.read(reinterpret_cast<char*>(&count), sizeof(int));
+		in.read(reinterpret_cast<char*>(&inputs), sizeof(int));
+		return std::make_unique<AddLayer>(count, inputs);
+	}
+};
+
+class ConcatLayer : public Layer {
+public:
+	// Concatenation of tensors with `count` neurons in total
+	// The stacked inputs already are the concatenation, so the layer passes them through
+	ConcatLayer(int count) : Layer(count, count) {}
+
+	bool isIdentity() const override { return true; }
+	NNMatrix run(const NNMatrix& x) override { return x; }
+	NNMatrix forward(const NNMatrix& x) override { return x; }
+	NNMatrix backward(const NNMatrix& dy) override { return dy; }
+	std::unique_ptr<Layer> clone() const override { return std::make_unique<ConcatLayer>(*this); }
+
+	void save(std::ofstream& out) override {
+		// Write the layer type
+		const std::string type = "Concat";
+		uint32_t size = type.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
+		out.write(type.c_str(), size);
+		// Write the number of neurons
+		out.write(reinterpret_cast<const char*>(&inCount), sizeof(int));
+	}
+	static std::unique_ptr<ConcatLayer> load(std::ifstream& in) {
+		// Layer type was read by static Layer::load
+		// Read the number of neurons
+		int count;
+		in.read(reinterpret_cast<char*>(&count), sizeof(int));
+		return std::make_unique<ConcatLayer>(count);
+	}
+};
+
 std::unique_ptr<Layer> Layer::load(std::ifstream& in) {
 	std::string type;
 	uint32_t size = 0;
@@ -218,7 +2413,24 @@ std::unique_ptr<Layer> Layer::load(std::ifstream& in) {
 	in.read(&type[0], size);
 	if (type == "Activation") return ActivationLayer::load(in);
 	if (type == "Dense") return DenseLayer::load(in);
+	if (type == "FusedDense") return FusedDenseLayer::load(in);
+	if (type == "LowRankDense") return LowRankDenseLayer::load(in);
 	if (type == "SIREN") return SIRENLayer::load(in);
+	if (type == "BatchNorm") return BatchNormLayer::load(in);
+	if (type == "LayerNorm") return LayerNormLayer::load(in);
+	if (type == "Dropout") return DropoutLayer::load(in);
+	if (type == "Embedding") return EmbeddingLayer::load(in);
+	if (type == "HashGridEncoding") return HashGridEncodingLayer::load(in);
+	if (type == "LSTM") return LSTMLayer::load(in);
+	if (type == "GRU") return GRULayer::load(in);
+	if (type == "MultiHeadAttention") return MultiHeadAttentionLayer::load(in);
+	if (type == "MaxPool2D") return MaxPool2DLayer::load(in);
+	if (type == "AvgPool2D") return AvgPool2DLayer::load(in);
+	if (type == "GlobalAvgPool") return GlobalAvgPoolLayer::load(in);
+	if (type == "DepthwiseConv2D") return DepthwiseConv2DLayer::load(in);
+	if (type == "PointwiseConv2D") return PointwiseConv2DLayer::load(in);
+	if (type == "Add") return AddLayer::load(in);
+	if (type == "Concat") return ConcatLayer::load(in);
 	throw std::runtime_error("Unknown layer type found.");
 }
 
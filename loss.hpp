@@ -7,28 +7,52 @@ namespace NNLoss {
 	double epsilon = 1e-12;
 	// Mean Squared Error
 	// MSE = 1/n * ∑(p_i - r_i)^2
-	inline double MSE(NNMatrix predicted, NNMatrix real) {
+	inline double MSE(const NNMatrix& predicted, const NNMatrix& real) {
 		return ((predicted - real) ^ 2.0).sum() / real.rows();
 	}
 	// Derivative of Mean Squared Error
 	// MSE' = 2/n * (p_i - r_i)
-	inline NNMatrix MSEDerivative(NNMatrix predicted, NNMatrix real) {
+	inline NNMatrix MSEDerivative(const NNMatrix& predicted, const NNMatrix& real) {
 		return 2.0 / real.rows() * (predicted - real);
 	}
+	// Derivative of Mean Squared Error written into `res` (No allocation when its shape matches)
+	inline void MSEDerivativeInto(const NNMatrix& predicted, const NNMatrix& real, NNMatrix& res) {
+		if (!NNMatrix::sameSize(predicted, real)) throw std::runtime_error("Loss dimension mismatch: " +
+			std::to_string(predicted.rows()) + "x" + std::to_string(predicted.cols()) + " predicted, " +
+			std::to_string(real.rows()) + "x" + std::to_string(real.cols()) + " real"
+		);
+		res.resize(real.rows(), real.cols());
+		for (int i = 0; i < real.rows(); i++) {
+			for (int j = 0; j < real.cols(); j++) res[i][j] = 2.0 / real.rows() * (predicted[i][j] - real[i][j]);
+		}
+	}
 	// Categorical Cross Entropy Loss
 	// CCE = - ∑ r_i log(p_i + ε)
-	inline double CCE(NNMatrix predicted, NNMatrix real) {
+	inline double CCE(const NNMatrix& predicted, const NNMatrix& real) {
 		double sum = 0;
-		predicted.forEach([&sum, &real](double *val, int i, int j) {
-			sum -= real[i][j] * std::log(*val + epsilon); // epsilon to avoid log(0)
-		});
+		for (int i = 0; i < predicted.rows(); i++) {
+			for (int j = 0; j < predicted.cols(); j++) {
+				sum -= real[i][j] * std::log(predicted[i][j] + epsilon); // epsilon to avoid log(0)
+			}
+		}
 		return sum;
 	}
 	// Derivative of Categorical Cross Entropy Loss
 	// CCE' = - r_i / (p_i + ε)
-	inline NNMatrix CCEDerivative(NNMatrix predicted, NNMatrix real) {
+	inline NNMatrix CCEDerivative(const NNMatrix& predicted, const NNMatrix& real) {
 		return -real / (predicted + epsilon); // epsilon to avoid / 0
 	}
+	// Derivative of Categorical Cross Entropy Loss written into `res` (No allocation when its shape matches)
+	inline void CCEDerivativeInto(const NNMatrix& predicted, const NNMatrix& real, NNMatrix& res) {
+		if (!NNMatrix::sameSize(predicted, real)) throw std::runtime_error("Loss dimension mismatch: " +
+			std::to_string(predicted.rows()) + "x" + std::to_string(predicted.cols()) + " predicted, " +
+			std::to_string(real.rows()) + "x" + std::to_string(real.cols()) + " real"
+		);
+		res.resize(real.rows(), real.cols());
+		for (int i = 0; i < real.rows(); i++) {
+			for (int j = 0; j < real.cols(); j++) res[i][j] = -real[i][j] / (predicted[i][j] + epsilon);
+		}
+	}
 }
 
 // Loss functions are network attributes and need to be specified in the network
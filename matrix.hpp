@@ -30,7 +30,7 @@ public:
 		}
 	}
 	// Check whether two matrices are of the same size
-	inline static bool sameSize(NNMatrix a, NNMatrix b) {
+	inline static bool sameSize(const NNMatrix& a, const NNMatrix& b) {
 		return (a.rows() == b.rows()) && (a.cols() == b.cols());
 	}
 	// Return a column matrix (nx1) given a flattened vector
@@ -47,7 +47,7 @@ public:
 		res.data = {{scalar}};
 		return res;
 	}
-	// Resize the number of rows and columns
+	// Resize the number of rows and columns (Existing storage is reused)
 	void resize(int rows, int cols) {
 		data.resize(rows);
 		for (int i = 0; i < rows; i++) {
@@ -230,6 +230,42 @@ public:
 		}
 		return result;
 	}
+	// Dot product of two optionally transposed matrices into `res` (Not both transposed)
+	// `res` is only reallocated when its shape differs, so repeated products of the same shapes do not allocate
+	static void dot(const NNMatrix& a, const NNMatrix& b, NNMatrix& res, bool transposeA, bool transposeB = false) {
+		if (transposeA && transposeB) throw std::runtime_error("Matrix dot product of two transposed matrices is not supported");
+		int m = transposeA ? a.cols() : a.rows(), k = transposeA ? a.rows() : a.cols();
+		int kb = transposeB ? b.cols() : b.rows(), n = transposeB ? b.rows() : b.cols();
+		if (k != kb) {
+			throw std::runtime_error("Matrix dot product dimension mismatch: " +
+				std::to_string(m) + "x" + std::to_string(k) + " . " +
+				std::to_string(kb) + "x" + std::to_string(n)
+			);
+		}
+		res.resize(m, n);
+		if (transposeB) { // res_ij = a_i . b_j
+			for (int i = 0; i < m; i++) {
+				const std::vector<double>& ai = a[i];
+				for (int j = 0; j < n; j++) {
+					const std::vector<double>& bj = b[j];
+					double sum = 0;
+					for (int p = 0; p < k; p++) sum += ai[p] * bj[p];
+					res[i][j] = sum;
+				}
+			}
+			return;
+		}
+		// Accumulate rows of b so the innermost loop is contiguous
+		for (int i = 0; i < m; i++) std::fill(res[i].begin(), res[i].end(), 0.0);
+		for (int p = 0; p < k; p++) {
+			const std::vector<double>& bp = b[p];
+			for (int i = 0; i < m; i++) {
+				double aip = transposeA ? a[p][i] : a[i][p];
+				std::vector<double>& ri = res[i];
+				for (int j = 0; j < n; j++) ri[j] += aip * bp[j];
+			}
+		}
+	}
 	// Transpose the matrix (Switch rows and columns)
 	NNMatrix transpose() const {
 		NNMatrix res(cols(), rows());
@@ -248,6 +284,89 @@ public:
 		});
 		return max;
 	}
+	// Get a column matrix (rows x 1) of the sum of each row
+	NNMatrix rowSum() const {
+		NNMatrix res(rows(), 1);
+		for (int i = 0; i < rows(); i++) {
+			for (int j = 0; j < cols(); j++) {
+				res[i][0] += data[i][j];
+			}
+		}
+		return res;
+	}
+	// Add a column matrix (rows x 1) to every column of the matrix
+	void addToColumns(const NNMatrix& col) {
+		if (col.rows() != rows() || col.cols() != 1) throw std::runtime_error("Matrix column broadcast dimension mismatch: " +
+			std::to_string(rows()) + "x" + std::to_string(cols()) + " + " +
+			std::to_string(col.rows()) + "x" + std::to_string(col.cols())
+		);
+		for (int i = 0; i < rows(); i++) {
+			for (int j = 0; j < cols(); j++) {
+				data[i][j] += col[i][0];
+			}
+		}
+	}
+	// Singular value decomposition a = u . diag(s) . v^T with one-sided Jacobi rotations
+	// For an m x n matrix and k = min(m, n): u is m x k, v is n x k and s holds the k singular values in descending order
+	static void svd(const NNMatrix& a, NNMatrix& u, std::vector<double>& s, NNMatrix& v) {
+		if (a.rows() < a.cols()) { // a^T = v . diag(s) . u^T
+			svd(a.transpose(), v, s, u);
+			return;
+		}
+		int m = a.rows(), n = a.cols();
+		// Rows of x are the columns of a, rotated in pairs until they are orthogonal
+		NNMatrix x = a.transpose(), vt(n, n);
+		for (int i = 0; i < n; i++) vt[i][i] = 1;
+		for (int sweep = 0; sweep < 64; sweep++) {
+			bool rotated = false;
+			for (int p = 0; p < n; p++) {
+				for (int q = p + 1; q < n; q++) {
+					std::vector<double> &xp = x[p], &xq = x[q];
+					double alpha = 0, beta = 0, gamma = 0;
+					for (int k = 0; k < m; k++) {
+						alpha += xp[k] * xp[k];
+						beta += xq[k] * xq[k];
+						gamma += xp[k] * xq[k];
+					}
+					if (std::abs(gamma) <= 1e-15 * std::sqrt(alpha * beta)) continue;
+					rotated = true;
+					double zeta = (beta - alpha) / (2 * gamma);
+					double t = (zeta >= 0 ? 1.0 : -1.0) / (std::abs(zeta) + std::sqrt(1 + zeta * zeta));
+					double c = 1 / std::sqrt(1 + t * t), sn = c * t;
+					for (int k = 0; k < m; k++) {
+						double xpk = xp[k];
+						xp[k] = c * xpk - sn * xq[k];
+						xq[k] = sn * xpk + c * xq[k];
+					}
+					std::vector<double> &vp = vt[p], &vq = vt[q];
+					for (int k = 0; k < n; k++) {
+						double vpk = vp[k];
+						vp[k] = c * vpk - sn * vq[k];
+						vq[k] = sn * vpk + c * vq[k];
+					}
+				}
+			}
+			if (!rotated) break;
+		}
+		// The singular values are the norms of the rotated columns
+		std::vector<double> norms(n, 0.0);
+		for (int j = 0; j < n; j++) {
+			for (double val : x[j]) norms[j] += val * val;
+			norms[j] = std::sqrt(norms[j]);
+		}
+		std::vector<int> order(n);
+		for (int j = 0; j < n; j++) order[j] = j;
+		std::stable_sort(order.begin(), order.end(), [&norms](int i, int j) { return norms[i] > norms[j]; });
+		u = NNMatrix(m, n);
+		v = NNMatrix(n, n);
+		s.assign(n, 0.0);
+		for (int j = 0; j < n; j++) {
+			int col = order[j];
+			s[j] = norms[col];
+			for (int i = 0; i < m; i++) u[i][j] = s[j] > 0 ? x[col][i] / s[j] : 0;
+			for (int i = 0; i < n; i++) v[i][j] = vt[col][i];
+		}
+	}
 	// Get the sum of all elements in the matrix
 	double sum() {
 		double sum = 0;
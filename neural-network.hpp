@@ -4,6 +4,7 @@
 #include <chrono>
 #include <iostream>
 #include <vector>
+#include <deque>
 #include <functional>
 #include <cmath>
 #include <random>
@@ -12,11 +13,85 @@
 #include <fstream>
 #include <algorithm>
 #include <memory>
+#include <thread>
+#include <exception>
+#include <typeinfo>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include "./matrix.hpp"
+#include "./random.hpp"
 #include "./activation.hpp"
 #include "./loss.hpp"
 #include "./layer.hpp"
 
+// Key and value caches of every layer of a network for incremental inference with NeuralNetwork::step()
+// Layers without attention have an empty cache
+class NNKVCache {
+public:
+	std::vector<NNAttentionCache> layers;
+	// Number of tokens currently cached
+	int length() const {
+		for (const NNAttentionCache& cache : layers) {
+			if (cache.capacity > 0) return cache.length;
+		}
+		return 0;
+	}
+	// Drop the `count` oldest tokens
+	void evict(int count) { for (NNAttentionCache& cache : layers) cache.evict(count); }
+	// Drop the newest tokens until `newLength` tokens are left
+	void truncate(int newLength) { for (NNAttentionCache& cache : layers) cache.truncate(newLength); }
+	void clear() { for (NNAttentionCache& cache : layers) cache.clear(); }
+};
+
+// A minibatch as a range [begin, end) of a dataset, optionally selected through an array of indices
+// Samples are read in place, so forming and propagating a minibatch never copies them
+class NNBatchView {
+public:
+	const std::vector<std::pair<NNMatrix, NNMatrix>>* data = nullptr;
+	const int* indices = nullptr;
+	int begin = 0, end = 0;
+	// Position of the first data point of the view in its sample (e.g. the share of a process), which stochastic layers seek to
+	int offset = 0;
+	// View of a whole dataset
+	NNBatchView(const std::vector<std::pair<NNMatrix, NNMatrix>>& data) : data(&data), end(data.size()) {}
+	// View of the samples data[i] (or data[indices[i]] when indices are given) for i in [begin, end)
+	NNBatchView(const std::vector<std::pair<NNMatrix, NNMatrix>>& data, int begin, int end, const int* indices = nullptr) :
+		data(&data), indices(indices), begin(begin), end(end) {}
+	int size() const { return end - begin; }
+	const std::pair<NNMatrix, NNMatrix>& operator[](int k) const {
+		int i = begin + k;
+		return (*data)[indices != nullptr ? indices[i] : i];
+	}
+};
+
+// Lock-free queue between a single producer thread and a single consumer thread (Used by pipeline-parallel training)
+// The ring holds up to `capacity` items, and pushing or popping never blocks
+template<typename T>
+class NNSPSCQueue {
+public:
+	NNSPSCQueue(size_t capacity) : slots(capacity + 1) {}
+	// Returns false when the queue is full (Producer only)
+	bool tryPush(T&& item) {
+		size_t t = tail.load(std::memory_order_relaxed), next = (t + 1) % slots.size();
+		if (next == head.load(std::memory_order_acquire)) return false;
+		slots[t] = std::move(item);
+		tail.store(next, std::memory_order_release);
+		return true;
+	}
+	// Returns false when the queue is empty (Consumer only)
+	bool tryPop(T& item) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) return false;
+		item = std::move(slots[h]);
+		head.store((h + 1) % slots.size(), std::memory_order_release);
+		return true;
+	}
+private:
+	std::vector<T> slots;
+	std::atomic<size_t> head{0}, tail{0};
+};
+
 class NeuralNetwork {
 public:
 	std::vector<std::unique_ptr<Layer>> layers;
@@ -26,99 +101,672 @@ public:
 
 	// Averaged gradients of each layer
 	std::vector<std::vector<NNMatrix>> avgGrads;
+	// Rows of each averaged gradient that are set for layers with sparse gradients (Sorted and unique)
+	std::vector<std::vector<std::vector<int>>> avgRows;
 	// Momentum buffers for training
 	std::vector<std::vector<NNMatrix>> momentumV, adamM, adamV;
 
+	// Optional graph structure (Empty for a linear chain of layers, see addNode())
+	// Each layer reads the named tensors in layerInputs and writes the named tensor in layerOutputs
+	std::vector<std::pair<std::string, int>> graphInputs; // Names and sizes
+	std::vector<std::string> graphOutputs;
+	std::vector<std::vector<std::string>> layerInputs;
+	std::vector<std::string> layerOutputs;
+
+	// Optional gradient checkpointing (Linear networks only)
+	// Training keeps the activations of every layer for backpropagation, which grows with depth and the number of columns
+	// With checkpointing, the layers are split into segments and only the input of each segment is kept during forward propagation;
+	// the activations of a segment are recomputed right before it is backpropagated and freed after it
+	// Segments start at the layer indices in `checkpoints`, or are chosen to fit `memoryBudget` bytes when it is set (see planCheckpoints())
+	std::vector<int> checkpoints;
+	size_t memoryBudget = 0;
+
+	// Number of threads computing the gradients of a batch in averagePDs() and averagePackedPDs() (Default 1)
+	// Each thread propagates a contiguous share of the batch through its own replica of the network, then the replica
+	// gradients are summed in a fixed pairwise tree, so the result only depends on the number of threads and not on scheduling
+	// Networks with layers that cannot be recomputed (BatchNormLayer updates its running statistics) always use a single thread
+	int threads = 1;
+
+	// Optional pipeline-parallel training (Linear networks only)
+	// With stages > 1, averagePDs() and averagePackedPDs() split the layers into contiguous stages of similar cost (see planStages()),
+	// each run by its own thread, and the batch into micro-batches (single samples, or `microBatches` groups of columns when packed)
+	// Stages hand activations forward and errors backward through lock-free queues with a one-forward-one-backward schedule:
+	// stage s keeps at most (stages - s) micro-batches in flight and runs a backward as soon as one arrives, so the forward of
+	// a later micro-batch overlaps the backward of an earlier one
+	// A stage only keeps the input of each micro-batch in flight and recomputes its activations right before the backward
+	// Gradients are added in micro-batch order, so the result does not depend on scheduling
+	// Pipelining takes precedence over `threads`, and networks with layers that cannot be recomputed use a single thread
+	int stages = 1, microBatches = 4;
+
+	// Optional callback with the index of a layer and the number of averaged data points once the layer's averaged gradients are final
+	// averagePDs() and averagePackedPDs() report every layer in reverse order; on a single thread each layer is reported right after
+	// its last backward propagation, so its gradients can be used (e.g. reduced across processes) while earlier layers are still
+	// backpropagated, and multithreaded or pipelined batches report all layers at the end
+	std::function<void(int, int)> gradsReady;
+
 	// Loss function for the network
 	std::string lossFnName;
-	std::function<double(NNMatrix, NNMatrix)> lossFn;
-	std::function<NNMatrix(NNMatrix, NNMatrix)> lossFnDerivative;
+	std::function<double(const NNMatrix&, const NNMatrix&)> lossFn;
+	std::function<NNMatrix(const NNMatrix&, const NNMatrix&)> lossFnDerivative;
+	// Loss derivative writing into a preallocated matrix (Used by compiled networks)
+	void (*lossFnDerivativeInto)(const NNMatrix&, const NNMatrix&, NNMatrix&) = nullptr;
 
 	// Setters
 
 	// Add a layer to the network (Usage: nn.addLayer<LayerType>(args); )
+	// In a graph network, the layer reads the last added tensor
 	template<typename LayerType, typename... Args>
 	void addLayer(Args&&... args) {
-		layers.push_back(std::make_unique<LayerType>(std::forward<Args>(args)...));
-		std::vector<NNMatrix>& lastGrads = layers.back()->grads;
-		// Pushing back the gradients directly works because they have just been initialized
-		avgGrads.push_back(lastGrads);
-		momentumV.push_back(lastGrads);
-		adamM.push_back(lastGrads);
-		adamV.push_back(lastGrads);
-		depth++;
+		if (isGraph()) {
+			std::string input = layerOutputs.empty() ? graphInputs.back().first : layerOutputs.back();
+			addNode<LayerType>({ input }, "#" + std::to_string(depth), std::forward<Args>(args)...);
+			return;
+		}
+		pushLayer(std::make_unique<LayerType>(std::forward<Args>(args)...));
+	}
+
+	// Graph networks
+	// Tensors are named; graph inputs are declared with setInputs() and every layer added with addNode() reads
+	// tensors that already exist and writes a new one, so the layers are always in a valid execution order
+	// A layer with several inputs receives their rows stacked in order (Use AddLayer and ConcatLayer to merge tensors)
+	// The network input is the stacked rows of the graph inputs and its output is the stacked rows of the graph outputs,
+	// so training, loss functions and saving work exactly like for linear networks
+
+	// Declare the graph inputs as names and sizes (Must be called before adding layers)
+	void setInputs(std::vector<std::pair<std::string, int>> inputs) {
+		if (depth > 0) throw std::runtime_error("Graph inputs must be declared before adding layers");
+		if (inputs.empty()) throw std::runtime_error("A graph needs at least one input");
+		graphInputs = inputs;
+		plan.valid = false;
+	}
+	// Declare the graph outputs (The last added tensor is the output by default)
+	void setOutputs(std::vector<std::string> outputs) {
+		if (!isGraph()) throw std::runtime_error("Outputs can only be declared for graph networks");
+		graphOutputs = outputs;
+		plan.valid = false;
+	}
+	// Add a layer reading the `inputs` tensors and writing the `output` tensor (Usage: nn.addNode<LayerType>({"x"}, "y", args); )
+	template<typename LayerType, typename... Args>
+	void addNode(std::vector<std::string> inputs, std::string output, Args&&... args) {
+		if (!isGraph()) throw std::runtime_error("Declare graph inputs with setInputs() before adding nodes");
+		std::unique_ptr<Layer> layer = std::make_unique<LayerType>(std::forward<Args>(args)...);
+		int size = 0;
+		for (const std::string& input : inputs) size += tensorSize(input);
+		if (inputs.empty() || size != layer->inCount) {
+			throw std::runtime_error("Inputs of tensor '" + output + "' have " + std::to_string(size) + " neurons but the layer takes " + std::to_string(layer->inCount));
+		}
+		if (tensorExists(output)) throw std::runtime_error("Tensor '" + output + "' already exists");
+		layerInputs.push_back(inputs);
+		layerOutputs.push_back(output);
+		pushLayer(std::move(layer));
+	}
+	// Whether the network is a graph instead of a linear chain of layers
+	bool isGraph() const { return !graphInputs.empty(); }
+	// Number of activation buffers the graph executor keeps alive at once (Tensors with disjoint lifetimes share one)
+	int activationSlots() {
+		if (!isGraph()) return std::min(depth + 1, 2);
+		buildPlan();
+		return plan.slots;
 	}
 
+	// Compiled execution
+	// compile() checks once that every layer takes as many neurons as the layer before it outputs and sets up a workspace
+	// with the output and input error of every layer, which forward and backward propagation of linear networks then reuse
+	// Layers implementing forwardInto() and backwardInto() write into the workspace, so propagating inputs with the same
+	// number of columns again does not allocate. Adding or removing layers undoes the compilation
+	// Checkpointed networks keep the regular path and run() never uses the workspace, so it can be called from several threads
+	void compile() {
+		if (layers.empty()) throw std::runtime_error("Cannot compile an empty network");
+		if (isGraph()) buildPlan(); // Graph layers are validated by addNode() and their activations already share slots
+		else {
+			for (int i = 1; i < depth; i++) {
+				if (layers[i]->inCount != layers[i - 1]->outCount) {
+					throw std::runtime_error("Layer " + std::to_string(i) + " takes " + std::to_string(layers[i]->inCount) +
+						" neurons but layer " + std::to_string(i - 1) + " outputs " + std::to_string(layers[i - 1]->outCount));
+				}
+			}
+		}
+		workspaceOutputs.resize(depth);
+		workspaceErrors.resize(depth);
+		compiled = true;
+	}
+	bool isCompiled() const { return compiled; }
+
 	// Set the loss function of the network
 	// Pass NNLossType as argument
 	void setLossFunction(std::string loss) {
 		if (loss == NNLossType::MSE) {
 			lossFn = NNLoss::MSE;
 			lossFnDerivative = NNLoss::MSEDerivative;
+			lossFnDerivativeInto = NNLoss::MSEDerivativeInto;
 		} else if (loss == NNLossType::CCE) {
 			lossFn = NNLoss::CCE;
 			lossFnDerivative = NNLoss::CCEDerivative;
+			lossFnDerivativeInto = NNLoss::CCEDerivativeInto;
 		} else throw std::runtime_error("Unknown loss function ('" + loss + "')");
 		lossFnName = loss;
 	}
 
 	// Accumulate and average the partial derivatives for each sample in the batch
-	void averagePDs(std::vector<std::pair<NNMatrix, NNMatrix>> batch) {
-		for (int i = 0; i < depth; i++) {
-			for (NNMatrix& avgGrad : avgGrads[i]) {
-				avgGrad.fill(0);
+	// A dataset converts to a view of all its samples, so `nn.averagePDs(dataset)` works as well
+	void averagePDs(const NNBatchView& batch) {
+		if (batch.size() == 0) throw std::runtime_error("Cannot propagate an empty batch");
+		if (pipelined(batch.size())) {
+			pipelinePDs(batch, false);
+			return;
+		}
+		if (parallelizable(batch.size())) {
+			parallelPDs(batch, false);
+			return;
+		}
+		clearAvgGrads();
+		finalPoints = 0;
+		try {
+			for (int k = 0; k < batch.size(); k++) {
+				const std::pair<NNMatrix, NNMatrix>& sample = batch[k];
+				seekLayers(batch.offset + k);
+				// The last backward propagation finishes the averaged gradients layer by layer
+				if (k == batch.size() - 1) finalPoints = batch.size();
+				backwardPropagation(propagate(sample.first), sample.second);
+				if (finalPoints == 0) accumulateAvgGrads();
 			}
+		} catch (...) {
+			// Later backward propagations must not finish a batch that failed
+			finalPoints = 0;
+			throw;
 		}
-		for (std::pair<NNMatrix, NNMatrix> sample : batch) {
-			NNMatrix predicted = forwardPropagation(sample.first);
-			backwardPropagation(predicted, sample.second);
-			for (int i = 0; i < depth; i++) {
-				for (int j = 0; j < layers[i]->grads.size(); j++) {
-					avgGrads[i][j] = avgGrads[i][j] + layers[i]->grads[j];
+		finalPoints = 0;
+	}
+
+	// Accumulate and average the partial derivatives of the batch in a single propagation
+	// The samples are packed into matrices with a column per sample, so layers see the whole batch at once
+	void averagePackedPDs(const NNBatchView& batch) {
+		if (batch.size() == 0) throw std::runtime_error("Cannot propagate an empty batch");
+		if (pipelined(batch.size())) {
+			pipelinePDs(batch, true);
+			return;
+		}
+		if (parallelizable(batch.size())) {
+			parallelPDs(batch, true);
+			return;
+		}
+		clearAvgGrads();
+		finalPoints = batch.size();
+		try {
+			accumulatePackedPDs(batch, 0, batch.size());
+		} catch (...) {
+			finalPoints = 0;
+			throw;
+		}
+		finalPoints = 0;
+	}
+
+	// Zero the averaged gradients (Only the set rows of sparse gradients are touched)
+	void clearAvgGrads() {
+		for (int i = 0; i < depth; i++) {
+			for (int j = 0; j < avgGrads[i].size(); j++) {
+				if (!layers[i]->sparseGrads) {
+					avgGrads[i][j].fill(0);
+					continue;
 				}
+				for (int r : avgRows[i][j]) std::fill(avgGrads[i][j][r].begin(), avgGrads[i][j][r].end(), 0.0);
+				avgRows[i][j].clear();
+			}
+		}
+	}
+	// Add the current layer gradients to the averaged gradients
+	void accumulateAvgGrads() {
+		for (int i = 0; i < depth; i++) {
+			Layer& layer = *layers[i];
+			for (int j = 0; j < layer.grads.size(); j++) {
+				addToAvgGrad(i, j, layer.grads[j], layer.sparseGrads ? &layer.gradRows[j] : nullptr);
+			}
+		}
+	}
+	// Multiply the averaged gradients by a scalar
+	void scaleAvgGrads(double scale) {
+		for (int i = 0; i < depth; i++) scaleAvgGrad(i, scale);
+	}
+
+	// Fold every BatchNormLayer that directly follows a DenseLayer into that layer's weights and biases
+	// y = γ * (W . x + B - μ) / sqrt(σ² + ε) + β = W' . x + B' where W' = s * W, B' = s * (B - μ) + β and s = γ / sqrt(σ² + ε)
+	// The folded network produces the same outputs as run() without the cost of normalization
+	void foldBatchNorm() {
+		for (int i = 1; i < depth; i++) {
+			BatchNormLayer* norm = dynamic_cast<BatchNormLayer*>(layers[i].get());
+			DenseLayer* dense = dynamic_cast<DenseLayer*>(layers[i - 1].get());
+			if (norm == nullptr || dense == nullptr || !chained(i)) continue;
+			for (int r = 0; r < dense->outCount; r++) {
+				double scale = norm->gamma[r][0] / std::sqrt(norm->runningVar[r][0] + norm->epsilon);
+				for (double& w : dense->W[r]) w *= scale;
+				dense->B[r][0] = (dense->B[r][0] - norm->runningMean[r][0]) * scale + norm->beta[r][0];
+			}
+			removeLayer(i);
+			i--;
+		}
+	}
+	// Rewrite a trained network for inference by running the passes below in order
+	// run() returns the same outputs up to rounding, and the optimized network is saved and loaded like any other
+	// Dropout layers are removed, so the network should not be trained further (Rewritten layers lose their training moments)
+	void optimize() {
+		removeIdentityLayers();
+		foldBatchNorm();
+		foldDenseLayers();
+		fuseActivations();
+	}
+	// Remove the layers that return their input in run(), like DropoutLayer (Graph layers with several inputs are kept)
+	void removeIdentityLayers() {
+		for (int i = depth - 1; i >= 0 && depth > 1; i--) {
+			if (!layers[i]->isIdentity() || (isGraph() && layerInputs[i].size() != 1)) continue;
+			removeLayer(i);
+		}
+	}
+	// Fold every DenseLayer that directly follows another DenseLayer into a single DenseLayer
+	// W2 . (W1 . x + B1) + B2 = W' . x + B' where W' = W2 . W1 and B' = W2 . B1 + B2
+	// Layers of in x mid and mid x out are only folded when it does not add multiplications (in * out <= mid * (in + out))
+	void foldDenseLayers() {
+		for (int i = 1; i < depth; i++) {
+			DenseLayer* second = dynamic_cast<DenseLayer*>(layers[i].get());
+			DenseLayer* first = dynamic_cast<DenseLayer*>(layers[i - 1].get());
+			if (first == nullptr || second == nullptr || !chained(i)) continue;
+			long long in = first->inCount, mid = first->outCount, out = second->outCount;
+			if (in * out > mid * (in + out)) continue;
+			std::unique_ptr<DenseLayer> folded = std::make_unique<DenseLayer>(in, out);
+			folded->W = NNMatrix::dot(second->W, first->W);
+			folded->B = NNMatrix::dot(second->W, first->B) + second->B;
+			layers[i] = std::move(folded);
+			resetLayerState(i);
+			// The folded layer now reads the input of the first layer
+			removeLayer(i - 1);
+			i--;
+		}
+	}
+	// Fuse every ActivationLayer that directly follows a DenseLayer into a FusedDenseLayer
+	void fuseActivations() {
+		for (int i = 1; i < depth; i++) {
+			ActivationLayer* activation = dynamic_cast<ActivationLayer*>(layers[i].get());
+			DenseLayer* dense = dynamic_cast<DenseLayer*>(layers[i - 1].get());
+			if (activation == nullptr || dense == nullptr || !chained(i)) continue;
+			replaceLayer(i - 1, FusedDenseLayer::fromLayers(*dense, *activation));
+			removeLayer(i);
+		}
+	}
+	// Fold an affine input normalization x' = scale * x + shift (column matrices with a row per input) into the first layer
+	// W . (scale * x + shift) + B = W' . x + B' where W' = W * scale (per column) and B' = W . shift + B
+	// The network then takes unnormalized inputs, e.g. scale = 1 / σ and shift = -μ / σ for a standardization x' = (x - μ) / σ
+	// The first layer must be a DenseLayer or FusedDenseLayer
+	void foldInputNormalization(const NNMatrix& scale, const NNMatrix& shift) {
+		if (layers.empty()) throw std::runtime_error("Cannot fold input normalization into an empty network");
+		if (isGraph()) throw std::runtime_error("Input normalization can only be folded into linear networks");
+		Layer& first = *layers[0];
+		if (dynamic_cast<DenseLayer*>(&first) == nullptr && dynamic_cast<FusedDenseLayer*>(&first) == nullptr) {
+			throw std::runtime_error("Input normalization can only be folded into a dense first layer");
+		}
+		if (scale.rows() != first.inCount || shift.rows() != first.inCount || scale.cols() != 1 || shift.cols() != 1) {
+			throw std::runtime_error("Input normalization must have " + std::to_string(first.inCount) + "x1 scale and shift");
+		}
+		NNMatrix &W = first.params[0], &B = first.params[1];
+		B = NNMatrix::dot(W, shift) + B;
+		for (int r = 0; r < W.rows(); r++) {
+			for (int c = 0; c < W.cols(); c++) W[r][c] *= scale[c][0];
+		}
+	}
+	// Remove the layer at `index` along with its gradients and training moments
+	// In a graph network, the layer must have a single input, which replaces its output wherever it was read
+	void removeLayer(int index) {
+		if (index < 0 || index >= depth) throw std::runtime_error("Layer index " + std::to_string(index) + " out of range");
+		if (isGraph()) {
+			if (layerInputs[index].size() != 1) throw std::runtime_error("Only layers with a single input can be removed from a graph");
+			const std::string input = layerInputs[index][0], output = layerOutputs[index];
+			for (std::vector<std::string>& names : layerInputs) std::replace(names.begin(), names.end(), output, input);
+			std::replace(graphOutputs.begin(), graphOutputs.end(), output, input);
+			if (graphOutputs.empty() && index == depth - 1) graphOutputs = { input };
+			layerInputs.erase(layerInputs.begin() + index);
+			layerOutputs.erase(layerOutputs.begin() + index);
+			plan.valid = false;
+		}
+		layers.erase(layers.begin() + index);
+		avgGrads.erase(avgGrads.begin() + index);
+		avgRows.erase(avgRows.begin() + index);
+		momentumV.erase(momentumV.begin() + index);
+		adamM.erase(adamM.begin() + index);
+		adamV.erase(adamV.begin() + index);
+		depth--;
+		compiled = false;
+	}
+	// Replace the DenseLayer at `index` with a LowRankDenseLayer from its truncated singular value decomposition
+	// The rank keeps `energy` of the squared singular values and is capped at `maxRank` (if positive), see LowRankDenseLayer::fromDense()
+	// Returns the chosen rank (The training moments of the layer are reset)
+	int factorizeDense(int index, int maxRank, double energy = 1.0) {
+		if (index < 0 || index >= depth) throw std::runtime_error("Layer index " + std::to_string(index) + " out of range");
+		DenseLayer* dense = dynamic_cast<DenseLayer*>(layers[index].get());
+		if (dense == nullptr) throw std::runtime_error("Layer " + std::to_string(index) + " is not a dense layer");
+		std::unique_ptr<LowRankDenseLayer> layer = LowRankDenseLayer::fromDense(*dense, maxRank, energy);
+		int rank = layer->rank;
+		replaceLayer(index, std::move(layer));
+		return rank;
+	}
+	// Remove output neurons of the DenseLayer at `index`, shrinking its weights and biases, the element-wise layers that follow it
+	// (ActivationLayer, DropoutLayer and BatchNormLayer) and the input columns of the next dense layer along with their training moments
+	void removeNeurons(int index, std::vector<int> neurons) {
+		if (index < 0 || index >= depth) throw std::runtime_error("Layer index " + std::to_string(index) + " out of range");
+		if (isGraph()) throw std::runtime_error("Neurons can only be removed from linear networks");
+		DenseLayer* dense = dynamic_cast<DenseLayer*>(layers[index].get());
+		if (dense == nullptr) throw std::runtime_error("Layer " + std::to_string(index) + " is not a dense layer");
+		std::sort(neurons.begin(), neurons.end());
+		neurons.erase(std::unique(neurons.begin(), neurons.end()), neurons.end());
+		std::vector<int> keep;
+		for (int r = 0, k = 0; r < dense->outCount; r++) {
+			if (k < neurons.size() && neurons[k] == r) k++;
+			else keep.push_back(r);
+		}
+		if (!neurons.empty() && (neurons.front() < 0 || neurons.back() >= dense->outCount)) throw std::runtime_error("Neuron index out of range");
+		if (keep.empty()) throw std::runtime_error("Cannot remove every neuron of a layer");
+		// Find the layer reading the neurons before changing anything
+		int next = index + 1;
+		while (next < depth) {
+			Layer* layer = layers[next].get();
+			ActivationLayer* activation = dynamic_cast<ActivationLayer*>(layer);
+			if (activation != nullptr && activation->fnName == NNActivationType::Softmax) throw std::runtime_error("Neurons cannot be removed before a softmax");
+			if (activation == nullptr && dynamic_cast<DropoutLayer*>(layer) == nullptr && dynamic_cast<BatchNormLayer*>(layer) == nullptr) break;
+			next++;
+		}
+		if (next == depth) throw std::runtime_error("Output neurons of the network cannot be removed");
+		Layer* consumer = layers[next].get();
+		int consumerParam = -1;
+		if (dynamic_cast<DenseLayer*>(consumer) != nullptr || dynamic_cast<SIRENLayer*>(consumer) != nullptr) consumerParam = 0; // W
+		else if (dynamic_cast<LowRankDenseLayer*>(consumer) != nullptr) consumerParam = 1; // V
+		else throw std::runtime_error("Neurons can only be removed before a dense layer");
+
+		selectParam(index, 0, keep, false);
+		selectParam(index, 1, keep, false);
+		dense->outCount = keep.size();
+		for (int i = index + 1; i < next; i++) {
+			if (BatchNormLayer* norm = dynamic_cast<BatchNormLayer*>(layers[i].get())) {
+				selectParam(i, 0, keep, false);
+				selectParam(i, 1, keep, false);
+				norm->runningMean = select(norm->runningMean, keep, false);
+				norm->runningVar = select(norm->runningVar, keep, false);
 			}
+			layers[i]->inCount = layers[i]->outCount = keep.size();
 		}
+		selectParam(next, consumerParam, keep, true);
+		consumer->inCount = keep.size();
+	}
+	// Multiply the parameters by their pruning masks (Called by NNTrainer after every update)
+	void applyMasks() {
 		for (int i = 0; i < depth; i++) {
-			for (NNMatrix& avgGrad : avgGrads[i]) {
-				avgGrad = avgGrad / batch.size();
+			Layer& layer = *layers[i];
+			for (int j = 0; j < layer.paramMasks.size(); j++) {
+				NNMatrix& mask = layer.paramMasks[j];
+				if (mask.rows() == 0) continue;
+				NNMatrix& param = layer.params[j];
+				for (int r = 0; r < param.rows(); r++) {
+					for (int c = 0; c < param.cols(); c++) param[r][c] *= mask[r][c];
+				}
 			}
 		}
 	}
+	// Replace the layer at `index` with a layer of the same input and output sizes along with its gradients and training moments
+	void replaceLayer(int index, std::unique_ptr<Layer> layer) {
+		if (index < 0 || index >= depth) throw std::runtime_error("Layer index " + std::to_string(index) + " out of range");
+		if (layer->inCount != layers[index]->inCount || layer->outCount != layers[index]->outCount) {
+			throw std::runtime_error("Replacement layer must have " + std::to_string(layers[index]->inCount) + " inputs and " + std::to_string(layers[index]->outCount) + " outputs");
+		}
+		layers[index] = std::move(layer);
+		resetLayerState(index);
+	}
+
+	// Position the randomness of stochastic layers for the `sample`th sample of the current iteration
+	void seekLayers(int sample) {
+		for (int i = 0; i < depth; i++) {
+			layers[i]->seek(i, iterationsTrained, sample);
+		}
+	}
 
 	// Performs a feed forward without storing inputs or outputs
-	NNMatrix run(NNMatrix input) {
+	NNMatrix run(const NNMatrix& input) {
 		if (layers.empty()) throw std::runtime_error("Cannot run an empty network");
+		if (isGraph()) return propagateGraph(input, false);
+		// The input is only read, the activations alternate through `output`
+		const NNMatrix* x = &input;
+		NNMatrix output;
 		for (auto& layer : layers) {
-			input = layer->run(input);
+			if (layer->isIdentity()) continue;
+			output = layer->run(*x);
+			x = &output;
+		}
+		return x == &input ? input : output;
+	}
+	// Create a cache of `capacity` tokens for every attention layer of the network
+	NNKVCache createKVCache(int capacity) {
+		NNKVCache cache;
+		for (auto& layer : layers) {
+			if (dynamic_cast<MultiHeadAttentionLayer*>(layer.get()) != nullptr) cache.layers.emplace_back(capacity, layer->inCount);
+			else cache.layers.emplace_back();
+		}
+		return cache;
+	}
+	// Run a single token through the network, attending to the tokens in the cache, and append it to the cache
+	// Equivalent to the last column of run() on the cached tokens followed by this one (while the cache is not full)
+	NNMatrix step(NNMatrix input, NNKVCache& cache) {
+		if (layers.empty()) throw std::runtime_error("Cannot step an empty network");
+		if (cache.layers.size() != layers.size()) throw std::runtime_error("Cache was not created for this network");
+		if (isGraph()) throw std::runtime_error("Graph networks cannot be stepped with a cache");
+		for (int i = 0; i < depth; i++) {
+			Layer* layer = layers[i].get();
+			if (MultiHeadAttentionLayer* attention = dynamic_cast<MultiHeadAttentionLayer*>(layer)) {
+				input = attention->step(input, cache.layers[i]);
+			} else if (dynamic_cast<LSTMLayer*>(layer) != nullptr || dynamic_cast<GRULayer*>(layer) != nullptr) {
+				throw std::runtime_error("Recurrent layers cannot be stepped with a cache");
+			} else if (!layer->isIdentity()) {
+				input = layer->run(input);
+			}
 		}
 		return input;
 	}
 	// Sets layer inputs and outputs after forward propagation of an input and returns network output
-	NNMatrix forwardPropagation(NNMatrix input) {
+	NNMatrix forwardPropagation(const NNMatrix& input) {
 		if (layers.empty()) throw std::runtime_error("Cannot forward propagate through an empty network");
-		for (auto& layer : layers) {
-			input = layer->forward(input);
+		if (isGraph()) return propagateGraph(input, true);
+		if (usesWorkspace()) return propagateCompiled(input);
+		segments.clear();
+		// The input is only read, the activations alternate through `output`
+		const NNMatrix* x = &input;
+		NNMatrix output;
+		if (checkpoints.empty() && memoryBudget == 0) {
+			for (auto& layer : layers) {
+				output = layer->forward(*x);
+				x = &output;
+			}
+			return output;
 		}
-		return input;
+		segments = planCheckpoints(input.cols());
+		segmentInputs.resize(segments.size());
+		for (int s = 0; s < segments.size(); s++) {
+			// The last segment is backpropagated first, so its activations are kept
+			bool last = s == segments.size() - 1;
+			if (!last) segmentInputs[s] = *x;
+			for (int i = segments[s].first; i < segments[s].second; i++) {
+				output = layers[i]->forward(*x);
+				x = &output;
+				if (!last && layers[i]->recomputable()) layers[i]->releaseState();
+			}
+		}
+		return output;
+	}
+	// Split the layers into checkpointed segments as [first, second) layer ranges for an input with `columns` columns
+	// Segments always end after layers that cannot be recomputed (They keep their activations)
+	// Without explicit `checkpoints`, the memory of a layer is estimated as (inCount + outCount) * columns doubles, the peak
+	// memory of a segmentation as the kept segment inputs plus the largest recomputed segment, and the fewest segments whose
+	// peak fits in `memoryBudget` are used (A single segment when all activations fit)
+	// Throws when no segmentation fits in the budget
+	std::vector<std::pair<int, int>> planCheckpoints(int columns) {
+		std::vector<bool> boundary(depth + 1, false);
+		boundary[0] = boundary[depth] = true;
+		for (int i = 0; i < depth; i++) {
+			if (!layers[i]->recomputable()) boundary[i + 1] = true;
+		}
+		auto split = [this](const std::vector<bool>& starts) {
+			std::vector<std::pair<int, int>> result;
+			for (int i = 1; i <= depth; i++) {
+				if (starts[i]) {
+					result.emplace_back(result.empty() ? 0 : result.back().second, i);
+				}
+			}
+			return result;
+		};
+		if (!checkpoints.empty()) {
+			for (int i : checkpoints) {
+				if (i < 0 || i > depth) throw std::runtime_error("Checkpoint index " + std::to_string(i) + " out of range");
+				boundary[i] = true;
+			}
+			return split(boundary);
+		}
+		std::vector<double> cost(depth);
+		double total = 0;
+		for (int i = 0; i < depth; i++) {
+			cost[i] = static_cast<double>(layers[i]->inCount + layers[i]->outCount) * columns * sizeof(double);
+			total += cost[i];
+		}
+		if (total <= memoryBudget) return { { 0, depth } };
+		// Greedily pack layers into segments of at most total / k bytes for every k and keep the fewest segments that fit
+		// (the lower peak among as many segments)
+		std::vector<bool> best;
+		int bestCount = 0;
+		double bestPeak = 0, lowestPeak = 0;
+		for (int k = 1; k <= depth; k++) {
+			double limit = total / k, size = 0, largest = 0, kept = 0;
+			std::vector<bool> starts = boundary;
+			for (int i = 0; i < depth; i++) {
+				if (i > 0 && !starts[i] && size + cost[i] > limit) starts[i] = true;
+				if (starts[i]) {
+					largest = std::max(largest, size);
+					size = 0;
+					kept += static_cast<double>(layers[i]->inCount) * columns * sizeof(double);
+				}
+				size += cost[i];
+			}
+			largest = std::max(largest, size);
+			double peak = kept + largest;
+			int count = std::count(starts.begin() + 1, starts.end(), true);
+			lowestPeak = k == 1 ? peak : std::min(lowestPeak, peak);
+			if (peak > memoryBudget) continue;
+			if (best.empty() || count < bestCount || (count == bestCount && peak < bestPeak)) {
+				best = starts;
+				bestCount = count;
+				bestPeak = peak;
+			}
+		}
+		if (best.empty()) {
+			throw std::runtime_error("No checkpoint segments fit the memory budget of " + std::to_string(memoryBudget) +
+				" bytes (The lowest estimated peak is " + std::to_string(static_cast<size_t>(lowestPeak)) + " bytes)");
+		}
+		return split(best);
+	}
+	// Split the layers into min(stages, depth) pipeline stages as [first, second) layer ranges
+	// The cost of a layer is estimated as its number of parameters plus its number of outputs, and every stage ends
+	// once it reaches its share of the total cost
+	std::vector<std::pair<int, int>> planStages() {
+		int count = std::max(1, std::min(stages, depth));
+		std::vector<double> cost(depth);
+		double total = 0;
+		for (int i = 0; i < depth; i++) {
+			cost[i] = layers[i]->outCount;
+			for (NNMatrix& param : layers[i]->params) cost[i] += static_cast<double>(param.rows()) * param.cols();
+			total += cost[i];
+		}
+		std::vector<std::pair<int, int>> result;
+		double sum = 0;
+		for (int i = 0, first = 0; i < depth; i++) {
+			sum += cost[i];
+			int left = count - 1 - result.size(); // Stages after the current one
+			// Leave at least a layer for every stage after the current one
+			if (left > 0 && (sum >= total * (result.size() + 1) / count || depth - 1 - i == left)) {
+				result.emplace_back(first, i + 1);
+				first = i + 1;
+			}
+			if (i == depth - 1) result.emplace_back(first, depth);
+		}
+		return result;
 	}
 	// Sets the layer gradients (partial derivatives of the loss with respect to its parameters)
 	// Note: forward propagation has to be called first and its recommended to pass its return value as `predicted`
-	void backwardPropagation(NNMatrix predicted, NNMatrix real) {
+	void backwardPropagation(const NNMatrix& predicted, const NNMatrix& real) {
 		if (layers.empty()) throw std::runtime_error("Cannot backward propagate through an empty network");
+		if (usesWorkspace()) {
+			if (lossFnDerivativeInto != nullptr) lossFnDerivativeInto(predicted, real, workspaceLoss);
+			else workspaceLoss = lossFnDerivative(predicted, real);
+			const NNMatrix* dy = &workspaceLoss;
+			for (int i = depth - 1; i >= 0; i--) {
+				layers[i]->backwardInto(*dy, workspaceErrors[i]);
+				dy = &workspaceErrors[i];
+				finishLayer(i);
+			}
+			return;
+		}
 		NNMatrix dy = lossFnDerivative(predicted, real);
-		for (int i = depth - 1; i >= 0; i--) {
-			dy = layers[i]->backward(dy);
+		if (isGraph()) {
+			backpropagateGraph(dy);
+			return;
+		}
+		if (segments.empty()) {
+			for (int i = depth - 1; i >= 0; i--) {
+				dy = layers[i]->backward(dy);
+				finishLayer(i);
+			}
+			return;
 		}
+		for (int s = segments.size() - 1; s >= 0; s--) {
+			int first = segments[s].first, end = segments[s].second;
+			if (s < segments.size() - 1) {
+				// Recompute the activations of the segment from its input
+				NNMatrix x = std::move(segmentInputs[s]);
+				segmentInputs[s] = NNMatrix();
+				for (int i = first; i < end && layers[i]->recomputable(); i++) x = layers[i]->forward(x);
+			}
+			for (int i = end - 1; i >= first; i--) {
+				dy = layers[i]->backward(dy);
+				finishLayer(i);
+				if (layers[i]->recomputable()) layers[i]->releaseState();
+			}
+		}
+		segments.clear();
 	}
 
 	// Save the parameters and architecture to an output file stream with an option to include the training state
 	void save(std::ofstream& out, bool includeTrainingData = false) {
-		// Write the depth
-		out.write(reinterpret_cast<const char*>(&depth), sizeof(int));
+		// Moments sharded across processes (see NNTrainer::gatherParams) only hold some of the rows
+		for (int i = 0; includeTrainingData && i < depth; i++) {
+			for (int j = 0; j < layers[i]->params.size(); j++) {
+				int rows = layers[i]->params[j].get().rows();
+				if (momentumV[i][j].rows() != rows || adamM[i][j].rows() != rows || adamV[i][j].rows() != rows) {
+					throw std::runtime_error("Cannot save a sharded optimizer state (Gather it first)");
+				}
+			}
+		}
+		// Write the depth (Negated for graph networks)
+		int storedDepth = isGraph() ? -depth : depth;
+		out.write(reinterpret_cast<const char*>(&storedDepth), sizeof(int));
 		// Write the layers
 		for (int i = 0; i < depth; i++) {
 			layers[i]->save(out);
 		}
+		if (isGraph()) {
+			// Write the graph inputs, the tensors read and written by each layer and the graph outputs
+			writeCount(out, graphInputs.size());
+			for (std::pair<std::string, int>& input : graphInputs) {
+				writeString(out, input.first);
+				out.write(reinterpret_cast<const char*>(&input.second), sizeof(int));
+			}
+			for (int i = 0; i < depth; i++) {
+				writeCount(out, layerInputs[i].size());
+				for (std::string& name : layerInputs[i]) writeString(out, name);
+				writeString(out, layerOutputs[i]);
+			}
+			writeCount(out, graphOutputs.size());
+			for (std::string& name : graphOutputs) writeString(out, name);
+		}
 		// Write the loss function
 		uint32_t size = lossFnName.size();
 		out.write(reinterpret_cast<const char*>(&size), sizeof(uint32_t));
@@ -140,21 +788,40 @@ public:
 		// Clear all vector attributes
 		layers.clear();
 		avgGrads.clear();
+		avgRows.clear();
 		momentumV.clear();
 		adamM.clear();
 		adamV.clear();
-		// Read the depth
-		in.read(reinterpret_cast<char*>(&depth), sizeof(int));
+		graphInputs.clear();
+		graphOutputs.clear();
+		layerInputs.clear();
+		layerOutputs.clear();
+		plan.valid = false;
+		compiled = false;
+		// Read the depth (Negated for graph networks)
+		int storedDepth = 0;
+		in.read(reinterpret_cast<char*>(&storedDepth), sizeof(int));
+		depth = 0;
 		// Read the layers
-		for (int i = 0; i < depth; i++) {
-			std::unique_ptr<Layer> layer = Layer::load(in);
-			layers.emplace_back(std::move(layer));
-			std::vector<NNMatrix>& lastGrads = layers.back()->grads;
-			// Pushing back the gradients directly works because they have just been initialized
-			avgGrads.push_back(lastGrads);
-			momentumV.push_back(lastGrads);
-			adamM.push_back(lastGrads);
-			adamV.push_back(lastGrads);
+		for (int i = 0; i < std::abs(storedDepth); i++) {
+			pushLayer(Layer::load(in));
+		}
+		if (storedDepth < 0) {
+			// Read the graph inputs, the tensors read and written by each layer and the graph outputs
+			graphInputs.resize(readCount(in));
+			for (std::pair<std::string, int>& input : graphInputs) {
+				input.first = readString(in);
+				in.read(reinterpret_cast<char*>(&input.second), sizeof(int));
+			}
+			layerInputs.resize(depth);
+			layerOutputs.resize(depth);
+			for (int i = 0; i < depth; i++) {
+				layerInputs[i].resize(readCount(in));
+				for (std::string& name : layerInputs[i]) name = readString(in);
+				layerOutputs[i] = readString(in);
+			}
+			graphOutputs.resize(readCount(in));
+			for (std::string& name : graphOutputs) name = readString(in);
 		}
 		// Read the loss function
 		uint32_t size = 0;
@@ -175,6 +842,525 @@ public:
 		}
 	}
 private:
+	// Execution plan of a graph network
+	// Tensors are numbered with the graph inputs first, followed by the output of each layer
+	// Each tensor is stored in a slot that is reused by later tensors once the tensor is dead (after its last reader)
+	struct GraphPlan {
+		bool valid = false;
+		std::vector<int> size, slot;
+		std::vector<int> inputs, outputs;
+		std::vector<std::vector<int>> layerIn;
+		std::vector<int> layerOut;
+		int slots = 0;
+	} plan;
+	// Activations of the last graph propagation, indexed by slot
+	std::vector<NNMatrix> graphSlots;
+	// Checkpointed segments of the last forward propagation and the kept input of each segment
+	std::vector<std::pair<int, int>> segments;
+	std::vector<NNMatrix> segmentInputs;
+
+	// Replicas of the network for multithreaded gradient computation
+	std::vector<std::unique_ptr<NeuralNetwork>> replicas;
+	// Workspace of a compiled network (see compile()) and the prediction of the regular path in propagate()
+	bool compiled = false;
+	std::vector<NNMatrix> workspaceOutputs, workspaceErrors;
+	NNMatrix workspaceLoss;
+	NNMatrix prediction;
+
+	// Whether forward and backward propagation use the workspace
+	bool usesWorkspace() const { return compiled && !isGraph() && checkpoints.empty() && memoryBudget == 0; }
+	// Forward propagate a linear network through the workspace and return a reference to the output in it
+	const NNMatrix& propagateCompiled(const NNMatrix& input) {
+		segments.clear();
+		const NNMatrix* x = &input;
+		for (int i = 0; i < depth; i++) {
+			layers[i]->forwardInto(*x, workspaceOutputs[i]);
+			x = &workspaceOutputs[i];
+		}
+		return *x;
+	}
+	// Forward propagation for training, which does not copy the output of a compiled network
+	const NNMatrix& propagate(const NNMatrix& input) {
+		if (usesWorkspace()) return propagateCompiled(input);
+		prediction = forwardPropagation(input);
+		return prediction;
+	}
+
+	// Number of data points of the batch when the running backward propagation is its last one (0 otherwise)
+	int finalPoints = 0;
+	// Add the gradients of layer i to its averaged gradients, average them and report them when finishing a batch
+	void finishLayer(int i) {
+		if (finalPoints == 0) return;
+		Layer& layer = *layers[i];
+		for (int j = 0; j < layer.grads.size(); j++) {
+			addToAvgGrad(i, j, layer.grads[j], layer.sparseGrads ? &layer.gradRows[j] : nullptr);
+		}
+		scaleAvgGrad(i, 1.0 / finalPoints);
+		if (gradsReady) gradsReady(i, finalPoints);
+	}
+	// Report every layer in reverse order after a batch averaged on several threads
+	void reportGrads(int points) {
+		if (!gradsReady) return;
+		for (int i = depth - 1; i >= 0; i--) gradsReady(i, points);
+	}
+	// Multiply the averaged gradients of layer i by a scalar
+	void scaleAvgGrad(int i, double scale) {
+		for (int j = 0; j < avgGrads[i].size(); j++) {
+			if (!layers[i]->sparseGrads) {
+				avgGrads[i][j] = avgGrads[i][j] * scale;
+				continue;
+			}
+			for (int r : avgRows[i][j]) {
+				for (double& val : avgGrads[i][j][r]) val *= scale;
+			}
+		}
+	}
+	// Add a gradient to an averaged gradient (Only the given sorted and unique rows when `rows` is set)
+	void addToAvgGrad(int i, int j, const NNMatrix& grad, const std::vector<int>* rows) {
+		NNMatrix& avg = avgGrads[i][j];
+		if (rows == nullptr) {
+			for (int r = 0; r < avg.rows(); r++) {
+				for (int c = 0; c < avg.cols(); c++) avg[r][c] += grad[r][c];
+			}
+			return;
+		}
+		for (int r : *rows) {
+			for (int c = 0; c < avg.cols(); c++) avg[r][c] += grad[r][c];
+		}
+		// Merge the sorted row lists
+		std::vector<int>& set = avgRows[i][j];
+		size_t mid = set.size();
+		set.insert(set.end(), rows->begin(), rows->end());
+		std::inplace_merge(set.begin(), set.begin() + mid, set.end());
+		set.erase(std::unique(set.begin(), set.end()), set.end());
+	}
+	// Propagate the samples [begin, end) of a batch at once and add their gradients to the averaged gradients
+	void accumulatePackedPDs(const NNBatchView& batch, int begin, int end) {
+		NNMatrix inputs = pack(batch, begin, end, false), outputs = pack(batch, begin, end, true);
+		// Column j is the (begin + j)th sample for stochastic layers
+		seekLayers(batch.offset + begin);
+		backwardPropagation(propagate(inputs), outputs);
+		// Layer gradients are already summed over the columns (and already added when finished by the backward propagation)
+		if (finalPoints == 0) accumulateAvgGrads();
+	}
+	// Matrix with the inputs (or outputs) of the samples [begin, end) of a batch as columns
+	static NNMatrix pack(const NNBatchView& batch, int begin, int end, bool outputs) {
+		NNMatrix res((outputs ? batch[0].second : batch[0].first).rows(), end - begin);
+		for (int j = 0; j < end - begin; j++) {
+			const NNMatrix& sample = outputs ? batch[begin + j].second : batch[begin + j].first;
+			// Multi-column data points (e.g. sequences) would lose every column but the first
+			if (sample.cols() != 1 || sample.rows() != res.rows()) {
+				throw std::runtime_error("Packed data points must be " + std::to_string(res.rows()) + "x1 " + (outputs ? "outputs" : "inputs") +
+					" but data point " + std::to_string(begin + j) + " is " + std::to_string(sample.rows()) + "x" + std::to_string(sample.cols()));
+			}
+			for (int i = 0; i < res.rows(); i++) res[i][j] = sample[i][0];
+		}
+		return res;
+	}
+	// Whether a batch is pipelined across stages
+	bool pipelined(int samples) const {
+		if (stages <= 1 || depth <= 1 || samples <= 1 || isGraph()) return false;
+		for (const auto& layer : layers) {
+			if (!layer->recomputable()) return false;
+		}
+		return true;
+	}
+	// Accumulate and average the partial derivatives of a batch pipelined across stages (see `stages`)
+	void pipelinePDs(const NNBatchView& batch, bool packed) {
+		std::vector<std::pair<int, int>> plan = planStages();
+		int count = plan.size();
+		// Micro-batches as sample ranges
+		std::vector<std::pair<int, int>> micro;
+		int total = packed ? std::min(microBatches, batch.size()) : batch.size();
+		for (int k = 0; k < total; k++) micro.emplace_back(batch.size() * k / total, batch.size() * (k + 1) / total);
+		// forwardQueues[s] feeds activations to stage s and backwardQueues[s] feeds errors to stage s
+		std::vector<std::unique_ptr<NNSPSCQueue<NNMatrix>>> forwardQueues, backwardQueues;
+		for (int s = 0; s < count; s++) {
+			forwardQueues.push_back(std::make_unique<NNSPSCQueue<NNMatrix>>(total));
+			backwardQueues.push_back(std::make_unique<NNSPSCQueue<NNMatrix>>(total));
+		}
+		auto input = [&batch, &micro, packed](int k, bool outputs) {
+			if (packed) return pack(batch, micro[k].first, micro[k].second, outputs);
+			return outputs ? batch[micro[k].first].second : batch[micro[k].first].first;
+		};
+		clearAvgGrads();
+		std::atomic<bool> failed(false);
+		std::vector<std::exception_ptr> errors(count);
+		std::vector<std::thread> workers;
+		for (int s = 0; s < count; s++) {
+			workers.emplace_back([this, &batch, &plan, &micro, &forwardQueues, &backwardQueues, &input, &failed, &errors, count, total, s]() {
+				try {
+					int first = plan[s].first, end = plan[s].second;
+					bool last = s == count - 1;
+					// Inputs of the micro-batches in flight and the micro-batch whose activations the layers hold
+					std::vector<NNMatrix> kept(total);
+					int forwarded = 0, backwarded = 0, current = -1;
+					auto forward = [this, &batch, &micro, first, end](NNMatrix x, int k) {
+						for (int i = first; i < end; i++) {
+							layers[i]->seek(i, iterationsTrained, batch.offset + micro[k].first);
+							x = layers[i]->forward(x);
+						}
+						return x;
+					};
+					auto backward = [&](NNMatrix dy) {
+						for (int i = end - 1; i >= first; i--) {
+							dy = layers[i]->backward(dy);
+							Layer& layer = *layers[i];
+							for (int j = 0; j < layer.grads.size(); j++) {
+								addToAvgGrad(i, j, layer.grads[j], layer.sparseGrads ? &layer.gradRows[j] : nullptr);
+							}
+						}
+						if (s > 0) send(*backwardQueues[s - 1], std::move(dy), failed);
+						kept[backwarded] = NNMatrix();
+						backwarded++;
+						current = -1;
+					};
+					while (backwarded < total && !failed) {
+						// Errors come back in micro-batch order
+						NNMatrix dy;
+						if (!last && backwardQueues[s]->tryPop(dy)) {
+							if (current != backwarded) forward(kept[backwarded], backwarded);
+							backward(std::move(dy));
+							continue;
+						}
+						NNMatrix x;
+						if (forwarded < total && forwarded - backwarded < count - s && (s == 0 ? (x = input(forwarded, false), true) : forwardQueues[s]->tryPop(x))) {
+							int k = forwarded++;
+							if (!last) kept[k] = x;
+							NNMatrix y = forward(std::move(x), k);
+							current = k;
+							if (!last) send(*forwardQueues[s + 1], std::move(y), failed);
+							else backward(lossFnDerivative(y, input(k, true))); // The last stage backpropagates right away
+							continue;
+						}
+						std::this_thread::yield();
+					}
+				} catch (...) {
+					errors[s] = std::current_exception();
+					failed = true;
+				}
+			});
+		}
+		for (std::thread& worker : workers) worker.join();
+		for (std::exception_ptr& error : errors) {
+			if (error) std::rethrow_exception(error);
+		}
+		scaleAvgGrads(1.0 / batch.size());
+		reportGrads(batch.size());
+	}
+	// Push into a queue, waiting while it is full unless another thread failed
+	static void send(NNSPSCQueue<NNMatrix>& queue, NNMatrix&& item, const std::atomic<bool>& failed) {
+		while (!queue.tryPush(std::move(item))) {
+			if (failed) return;
+			std::this_thread::yield();
+		}
+	}
+	// Whether a batch is split across threads
+	bool parallelizable(int samples) const {
+		if (threads <= 1 || samples <= 1) return false;
+		for (const auto& layer : layers) {
+			if (!layer->recomputable()) return false;
+		}
+		return true;
+	}
+	// Make `count` replicas sharing the parameters of the network (Replicas are rebuilt when the layers changed)
+	// Replica layers are clones that read the parameter matrices of the network, so replicas only own their gradients and activations
+	void syncReplicas(int count) {
+		bool valid = replicas.size() == count;
+		for (int w = 0; valid && w < count; w++) {
+			NeuralNetwork& replica = *replicas[w];
+			valid = replica.depth == depth && replica.lossFnName == lossFnName && replica.graphInputs == graphInputs &&
+				replica.layerInputs == layerInputs && replica.layerOutputs == layerOutputs && replica.graphOutputs == graphOutputs;
+			for (int i = 0; valid && i < depth; i++) {
+				const Layer &a = *replica.layers[i], &b = *layers[i];
+				valid = typeid(a) == typeid(b) && a.inCount == b.inCount && a.outCount == b.outCount && a.params.size() == b.params.size();
+				for (int j = 0; valid && j < b.params.size(); j++) valid = &a.params[j].get() == &b.params[j].get();
+			}
+		}
+		if (!valid) {
+			replicas.clear();
+			for (int w = 0; w < count; w++) {
+				std::unique_ptr<NeuralNetwork> replica = std::make_unique<NeuralNetwork>();
+				for (const auto& layer : layers) replica->pushLayer(layer->clone());
+				replica->graphInputs = graphInputs;
+				replica->graphOutputs = graphOutputs;
+				replica->layerInputs = layerInputs;
+				replica->layerOutputs = layerOutputs;
+				replica->setLossFunction(lossFnName);
+				// Cloned layers carry their last gradients, which pushLayer() assumes to be zero
+				for (std::vector<NNMatrix>& grads : replica->avgGrads) {
+					for (NNMatrix& grad : grads) grad.fill(0);
+				}
+				// Replicas are never updated by an optimizer
+				replica->momentumV.clear();
+				replica->adamM.clear();
+				replica->adamV.clear();
+				replicas.push_back(std::move(replica));
+			}
+		}
+		for (std::unique_ptr<NeuralNetwork>& replica : replicas) {
+			replica->iterationsTrained = iterationsTrained;
+			replica->checkpoints = checkpoints;
+			replica->memoryBudget = memoryBudget;
+			if (compiled && !replica->compiled) replica->compile();
+		}
+	}
+	// Accumulate and average the partial derivatives of a batch split across `threads` replicas
+	void parallelPDs(const NNBatchView& batch, bool packed) {
+		int count = std::min(threads, batch.size());
+		syncReplicas(count);
+		std::vector<std::thread> workers;
+		std::vector<std::exception_ptr> errors(count);
+		for (int w = 0; w < count; w++) {
+			workers.emplace_back([this, &batch, &errors, packed, count, w]() {
+				try {
+					NeuralNetwork& replica = *replicas[w];
+					int begin = batch.size() * w / count, end = batch.size() * (w + 1) / count;
+					replica.clearAvgGrads();
+					if (packed) {
+						replica.accumulatePackedPDs(batch, begin, end);
+						return;
+					}
+					for (int k = begin; k < end; k++) {
+						replica.seekLayers(batch.offset + k);
+						replica.backwardPropagation(replica.propagate(batch[k].first), batch[k].second);
+						replica.accumulateAvgGrads();
+					}
+				} catch (...) {
+					errors[w] = std::current_exception();
+				}
+			});
+		}
+		for (std::thread& worker : workers) worker.join();
+		for (std::exception_ptr& error : errors) {
+			if (error) std::rethrow_exception(error);
+		}
+		// Sum the replica gradients pairwise into the first replica
+		for (int stride = 1; stride < count; stride *= 2) {
+			for (int w = 0; w + stride < count; w += 2 * stride) replicas[w]->addAvgGrads(*replicas[w + stride]);
+		}
+		clearAvgGrads();
+		addAvgGrads(*replicas[0]);
+		scaleAvgGrads(1.0 / batch.size());
+		reportGrads(batch.size());
+	}
+	// Add the averaged gradients of a network with the same layers
+	void addAvgGrads(NeuralNetwork& other) {
+		for (int i = 0; i < depth; i++) {
+			for (int j = 0; j < avgGrads[i].size(); j++) {
+				addToAvgGrad(i, j, other.avgGrads[i][j], layers[i]->sparseGrads ? &other.avgRows[i][j] : nullptr);
+			}
+		}
+	}
+	// Append a layer with its gradients and training moments
+	void pushLayer(std::unique_ptr<Layer> layer) {
+		layers.push_back(std::move(layer));
+		std::vector<NNMatrix>& lastGrads = layers.back()->grads;
+		// Pushing back the gradients directly works because they have just been initialized
+		avgGrads.push_back(lastGrads);
+		avgRows.emplace_back(lastGrads.size());
+		momentumV.push_back(lastGrads);
+		adamM.push_back(lastGrads);
+		adamV.push_back(lastGrads);
+		depth++;
+		plan.valid = false;
+		compiled = false;
+	}
+	// Reset the averaged gradients and training moments of a new layer at `index`
+	void resetLayerState(int index) {
+		std::vector<NNMatrix>& grads = layers[index]->grads;
+		// The gradients of a new layer are zero, like in pushLayer()
+		avgGrads[index] = grads;
+		avgRows[index] = std::vector<std::vector<int>>(grads.size());
+		momentumV[index] = grads;
+		adamM[index] = grads;
+		adamV[index] = grads;
+		plan.valid = false;
+	}
+	// Whether layer i only reads the output of layer i - 1 and is its only reader (Always in linear networks)
+	bool chained(int i) const {
+		return !isGraph() || (layerInputs[i].size() == 1 && layerInputs[i][0] == layerOutputs[i - 1] && consumers(layerOutputs[i - 1]) == 1);
+	}
+	// Keep the given rows (or columns) of a matrix in order
+	static NNMatrix select(const NNMatrix& m, const std::vector<int>& keep, bool columns) {
+		NNMatrix res(columns ? m.rows() : keep.size(), columns ? keep.size() : m.cols());
+		for (int i = 0; i < res.rows(); i++) {
+			for (int j = 0; j < res.cols(); j++) {
+				res[i][j] = columns ? m[i][keep[j]] : m[keep[i]][j];
+			}
+		}
+		return res;
+	}
+	// Keep the given rows (or columns) of a layer parameter along with its gradients, training moments and pruning mask
+	void selectParam(int index, int param, const std::vector<int>& keep, bool columns) {
+		Layer& layer = *layers[index];
+		NNMatrix& value = layer.params[param];
+		value = select(value, keep, columns);
+		layer.grads[param] = select(layer.grads[param], keep, columns);
+		avgGrads[index][param] = select(avgGrads[index][param], keep, columns);
+		momentumV[index][param] = select(momentumV[index][param], keep, columns);
+		adamM[index][param] = select(adamM[index][param], keep, columns);
+		adamV[index][param] = select(adamV[index][param], keep, columns);
+		if (param < layer.paramMasks.size() && layer.paramMasks[param].rows() > 0) {
+			layer.paramMasks[param] = select(layer.paramMasks[param], keep, columns);
+		}
+	}
+	bool tensorExists(const std::string& name) const {
+		for (const std::pair<std::string, int>& input : graphInputs) {
+			if (input.first == name) return true;
+		}
+		return std::find(layerOutputs.begin(), layerOutputs.end(), name) != layerOutputs.end();
+	}
+	// Number of neurons of a named tensor
+	int tensorSize(const std::string& name) const {
+		for (const std::pair<std::string, int>& input : graphInputs) {
+			if (input.first == name) return input.second;
+		}
+		for (int i = 0; i < layerOutputs.size(); i++) {
+			if (layerOutputs[i] == name) return layers[i]->outCount;
+		}
+		throw std::runtime_error("Unknown tensor '" + name + "'");
+	}
+	// Number of layers and graph outputs reading a named tensor
+	int consumers(const std::string& name) const {
+		int count = std::count(graphOutputs.begin(), graphOutputs.end(), name);
+		if (graphOutputs.empty() && !layerOutputs.empty() && layerOutputs.back() == name) count++;
+		for (const std::vector<std::string>& names : layerInputs) count += std::count(names.begin(), names.end(), name);
+		return count;
+	}
+	// Resolve tensor names, compute tensor lifetimes and assign slots
+	void buildPlan() {
+		if (plan.valid) return;
+		std::unordered_map<std::string, int> ids;
+		plan = GraphPlan();
+		for (std::pair<std::string, int>& input : graphInputs) {
+			ids[input.first] = plan.size.size();
+			plan.inputs.push_back(plan.size.size());
+			plan.size.push_back(input.second);
+		}
+		auto id = [&ids](const std::string& name) {
+			auto it = ids.find(name);
+			if (it == ids.end()) throw std::runtime_error("Unknown tensor '" + name + "'");
+			return it->second;
+		};
+		for (int i = 0; i < depth; i++) {
+			plan.layerIn.emplace_back();
+			for (std::string& name : layerInputs[i]) plan.layerIn[i].push_back(id(name));
+			ids[layerOutputs[i]] = plan.size.size();
+			plan.layerOut.push_back(plan.size.size());
+			plan.size.push_back(layers[i]->outCount);
+		}
+		if (graphOutputs.empty()) plan.outputs.push_back(plan.size.size() - 1);
+		for (std::string& name : graphOutputs) plan.outputs.push_back(id(name));
+		// The last layer reading each tensor (Graph outputs live until the end)
+		std::vector<int> lastUse(plan.size.size(), -1);
+		for (int i = 0; i < depth; i++) {
+			for (int t : plan.layerIn[i]) lastUse[t] = i;
+		}
+		for (int t : plan.outputs) lastUse[t] = depth;
+		// Assign slots, freeing the slots of tensors after their last reader
+		std::vector<int> freeSlots;
+		plan.slot.assign(plan.size.size(), -1);
+		auto allocate = [this, &freeSlots](int t) {
+			if (freeSlots.empty()) plan.slot[t] = plan.slots++;
+			else {
+				plan.slot[t] = freeSlots.back();
+				freeSlots.pop_back();
+			}
+		};
+		for (int t : plan.inputs) allocate(t);
+		for (int t : plan.inputs) {
+			if (lastUse[t] == -1) freeSlots.push_back(plan.slot[t]);
+		}
+		for (int i = 0; i < depth; i++) {
+			for (int k = 0; k < plan.layerIn[i].size(); k++) {
+				int t = plan.layerIn[i][k];
+				bool first = std::find(plan.layerIn[i].begin(), plan.layerIn[i].begin() + k, t) == plan.layerIn[i].begin() + k;
+				if (lastUse[t] == i && first) freeSlots.push_back(plan.slot[t]);
+			}
+			allocate(plan.layerOut[i]);
+			if (lastUse[plan.layerOut[i]] == -1) freeSlots.push_back(plan.slot[plan.layerOut[i]]);
+		}
+		plan.valid = true;
+	}
+	// Stack the rows of the given tensors
+	NNMatrix stackTensors(const std::vector<int>& tensors) {
+		int rows = 0;
+		for (int t : tensors) rows += plan.size[t];
+		NNMatrix stacked;
+		stacked.data.reserve(rows);
+		for (int t : tensors) {
+			NNMatrix& m = graphSlots[plan.slot[t]];
+			stacked.data.insert(stacked.data.end(), m.data.begin(), m.data.end());
+		}
+		return stacked;
+	}
+	// Add consecutive row blocks of `m` to the gradients of the given tensors
+	void splitGrads(const NNMatrix& m, const std::vector<int>& tensors, std::vector<NNMatrix>& grads) {
+		int row = 0;
+		for (int t : tensors) {
+			if (grads[t].rows() == 0) grads[t] = NNMatrix(plan.size[t], m.cols());
+			for (int i = 0; i < plan.size[t]; i++, row++) {
+				std::vector<double>& dst = grads[t][i];
+				const std::vector<double>& src = m[row];
+				for (int j = 0; j < m.cols(); j++) dst[j] += src[j];
+			}
+		}
+	}
+	// Propagate the stacked graph inputs through the graph and return the stacked graph outputs
+	NNMatrix propagateGraph(const NNMatrix& input, bool store) {
+		buildPlan();
+		graphSlots.resize(plan.slots);
+		int total = 0;
+		for (int t : plan.inputs) total += plan.size[t];
+		if (input.rows() != total) throw std::runtime_error("Graph expects " + std::to_string(total) + " input neurons but got " + std::to_string(input.rows()));
+		int row = 0;
+		for (int t : plan.inputs) {
+			graphSlots[plan.slot[t]].data.assign(input.data.begin() + row, input.data.begin() + row + plan.size[t]);
+			row += plan.size[t];
+		}
+		for (int i = 0; i < depth; i++) {
+			Layer& layer = *layers[i];
+			const std::vector<int>& in = plan.layerIn[i];
+			NNMatrix stacked;
+			if (in.size() > 1) stacked = stackTensors(in);
+			const NNMatrix& x = in.size() > 1 ? stacked : graphSlots[plan.slot[in[0]]];
+			NNMatrix y = store ? layer.forward(x) : layer.isIdentity() ? x : layer.run(x);
+			graphSlots[plan.slot[plan.layerOut[i]]] = std::move(y);
+		}
+		return stackTensors(plan.outputs);
+	}
+	// Backpropagate the error of the stacked graph outputs
+	// The gradient of each tensor is released as soon as the layer that wrote it has been backpropagated
+	void backpropagateGraph(const NNMatrix& dy) {
+		std::vector<NNMatrix> grads(plan.size.size());
+		splitGrads(dy, plan.outputs, grads);
+		for (int i = depth - 1; i >= 0; i--) {
+			int t = plan.layerOut[i];
+			NNMatrix d = grads[t].rows() > 0 ? std::move(grads[t]) : NNMatrix(plan.size[t], dy.cols());
+			grads[t] = NNMatrix();
+			splitGrads(layers[i]->backward(d), plan.layerIn[i], grads);
+			finishLayer(i);
+		}
+	}
+	// Helpers to write and read counts and strings to file streams
+	static void writeCount(std::ofstream& out, uint32_t count) {
+		out.write(reinterpret_cast<const char*>(&count), sizeof(uint32_t));
+	}
+	static uint32_t readCount(std::ifstream& in) {
+		uint32_t count = 0;
+		in.read(reinterpret_cast<char*>(&count), sizeof(uint32_t));
+		return count;
+	}
+	static void writeString(std::ofstream& out, const std::string& str) {
+		writeCount(out, str.size());
+		out.write(str.c_str(), str.size());
+	}
+	static std::string readString(std::ifstream& in) {
+		std::string str(readCount(in), '\0');
+		in.read(&str[0], str.size());
+		return str;
+	}
 	// Helper to write a moment tensor to an output file stream (Assumes tensor dimensions are known)
 	void saveTrainingMoment(std::vector<std::vector<NNMatrix>>& moment, std::ofstream& out) {
 		for (std::vector<NNMatrix>& layerMoment : moment) {
@@ -198,6 +1384,7 @@ private:
 };
 
 #include "./inits.hpp"
+#include "./pruning.hpp"
 #include "./trainer.hpp"
 
 #endif
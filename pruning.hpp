@@ -0,0 +1,96 @@
+#ifndef PRUNING_HPP
+#define PRUNING_HPP
+
+#include "./neural-network.hpp"
+
+namespace NNPruning {
+	// Unstructured pruning
+
+	// Magnitude pruning
+	// Zero the `sparsity` fraction of the weights with the smallest magnitudes in every DenseLayer
+	// The pruned weights are masked so they stay zero while training with NNTrainer (Masks are not saved)
+	// Already pruned weights count towards the sparsity, so pruning can be repeated with increasing sparsities
+	inline void magnitude(NeuralNetwork& nn, double sparsity) {
+		if (sparsity < 0 || sparsity > 1) throw std::runtime_error("Pruning sparsity must be in [0, 1]");
+		for (int i = 0; i < nn.depth; i++) {
+			DenseLayer* layer = dynamic_cast<DenseLayer*>(nn.layers[i].get());
+			if (layer == nullptr) continue; // Continue for non-DenseLayers
+
+			int rows = layer->W.rows(), cols = layer->W.cols();
+			std::vector<int> order(rows * cols);
+			for (int k = 0; k < order.size(); k++) order[k] = k;
+			int pruned = static_cast<int>(sparsity * order.size());
+			// Partition the entries so the `pruned` smallest magnitudes come first
+			std::nth_element(order.begin(), order.begin() + pruned, order.end(), [layer, cols](int a, int b) {
+				return std::abs(layer->W[a / cols][a % cols]) < std::abs(layer->W[b / cols][b % cols]);
+			});
+			NNMatrix mask(rows, cols);
+			mask.fill(1);
+			for (int k = 0; k < pruned; k++) mask[order[k] / cols][order[k] % cols] = 0;
+			layer->paramMasks.resize(layer->params.size());
+			layer->paramMasks[0] = mask;
+		}
+		nn.applyMasks();
+	}
+	// Remove the pruning masks of every layer (Pruned weights stay zero until they are trained)
+	inline void clearMasks(NeuralNetwork& nn) {
+		for (int i = 0; i < nn.depth; i++) {
+			nn.layers[i]->paramMasks.clear();
+		}
+	}
+	// Fraction of the weights of all DenseLayers that are zero
+	inline double sparsity(NeuralNetwork& nn) {
+		long long zeros = 0, total = 0;
+		for (int i = 0; i < nn.depth; i++) {
+			DenseLayer* layer = dynamic_cast<DenseLayer*>(nn.layers[i].get());
+			if (layer == nullptr) continue; // Continue for non-DenseLayers
+
+			layer->W.forEach([&zeros, &total](double *val, int, int) {
+				zeros += *val == 0;
+				total++;
+			});
+		}
+		return total == 0 ? 0 : static_cast<double>(zeros) / total;
+	}
+
+	// Structured pruning
+
+	// Neuron pruning
+	// Physically remove the `fraction` of the output neurons of the DenseLayer at `index` with the lowest scores
+	// The score of a neuron is the norm of its incoming weights times the norm of its outgoing weights in the next dense layer
+	// The layer, the element-wise layers after it and the next dense layer shrink (see NeuralNetwork::removeNeurons())
+	// Returns the number of removed neurons
+	inline int neurons(NeuralNetwork& nn, int index, double fraction) {
+		if (fraction < 0 || fraction >= 1) throw std::runtime_error("Pruning fraction must be in [0, 1)");
+		if (index < 0 || index >= nn.depth) throw std::runtime_error("Layer index " + std::to_string(index) + " out of range");
+		DenseLayer* layer = dynamic_cast<DenseLayer*>(nn.layers[index].get());
+		if (layer == nullptr) throw std::runtime_error("Layer " + std::to_string(index) + " is not a dense layer");
+		// Outgoing weights of the dense layer reading the neurons (Scores only use incoming weights when it is not a DenseLayer)
+		NNMatrix* next = nullptr;
+		for (int i = index + 1; i < nn.depth; i++) {
+			Layer* after = nn.layers[i].get();
+			if (DenseLayer* dense = dynamic_cast<DenseLayer*>(after)) next = &dense->W;
+			if (dynamic_cast<ActivationLayer*>(after) == nullptr && dynamic_cast<DropoutLayer*>(after) == nullptr && dynamic_cast<BatchNormLayer*>(after) == nullptr) break;
+		}
+		std::vector<double> scores(layer->outCount);
+		for (int r = 0; r < layer->outCount; r++) {
+			double in = 0, out = 0;
+			for (double w : layer->W[r]) in += w * w;
+			if (next != nullptr) {
+				for (int k = 0; k < next->rows(); k++) out += (*next)[k][r] * (*next)[k][r];
+			} else out = 1;
+			scores[r] = std::sqrt(in * out);
+		}
+		std::vector<int> order(layer->outCount);
+		for (int r = 0; r < order.size(); r++) order[r] = r;
+		int removed = static_cast<int>(fraction * order.size());
+		std::nth_element(order.begin(), order.begin() + removed, order.end(), [&scores](int a, int b) { return scores[a] < scores[b]; });
+		nn.removeNeurons(index, std::vector<int>(order.begin(), order.begin() + removed));
+		return removed;
+	}
+}
+
+// Pruning functions are standalone functions and not network attributes
+// Structured pruning changes the architecture, so the pruned network is saved and loaded like any other
+
+#endif
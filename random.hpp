@@ -0,0 +1,37 @@
+#ifndef RANDOM_HPP
+#define RANDOM_HPP
+
+#include "./neural-network.hpp"
+
+namespace NNRandom {
+	// Philox4x32-10 counter-based random number generator (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3")
+	// Every output is a pure function of the 128-bit counter and 64-bit key, so any random value can be
+	// generated directly from its coordinates without sequential generator state
+	struct Philox4x32 {
+		uint32_t v[4];
+	};
+	inline Philox4x32 philox(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3, uint32_t k0, uint32_t k1) {
+		for (int round = 0; round < 10; round++) {
+			uint64_t p0 = static_cast<uint64_t>(0xD2511F53u) * c0;
+			uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57u) * c2;
+			uint32_t n0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+			uint32_t n2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+			c0 = n0;
+			c1 = static_cast<uint32_t>(p1);
+			c2 = n2;
+			c3 = static_cast<uint32_t>(p0);
+			k0 += 0x9E3779B9u;
+			k1 += 0xBB67AE85u;
+		}
+		return {{ c0, c1, c2, c3 }};
+	}
+	// Mix a 64-bit value into a well distributed 64-bit value (splitmix64 finalizer)
+	inline uint64_t mix(uint64_t x) {
+		x += 0x9E3779B97F4A7C15ull;
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+		return x ^ (x >> 31);
+	}
+}
+
+#endif
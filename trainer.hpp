@@ -8,11 +8,11 @@ enum class NNOptimizerType { GradientDescent, Momentum, Adam };
 class NNTrainer {
 public:
 	NeuralNetwork& nn;
-	std::vector<std::pair<NNMatrix, NNMatrix>>& batch;
+	const std::vector<std::pair<NNMatrix, NNMatrix>>& batch; // Read only
 	std::function<void()> iterationCallback = []() {};
 	std::function<void()> epochCallback = []() {};
 	// Network reference and batch reference constructor
-	NNTrainer(NeuralNetwork& nn, std::vector<std::pair<NNMatrix, NNMatrix>>& batch) : nn(nn), batch(batch) {}
+	NNTrainer(NeuralNetwork& nn, const std::vector<std::pair<NNMatrix, NNMatrix>>& batch) : nn(nn), batch(batch) {}
 	// Used for gradient descent, momentum and adam (Default 0.001)
 	double learningRate = 0.001;
 	// Used for momentum (Default 0.9)
@@ -26,28 +26,75 @@ public:
 	// Training data is split into smaller samples of `sampleSize` to be processed individually
 	// sampleSize is -1 by default, meaning the whole batch is processed at once
 	int sampleSize = -1;
-	// Training data is shuffled before every epoch by default
+	// Training data is shuffled before every epoch by default (The order of the batch itself is left untouched)
 	bool enableShuffling = true;
+	// When enabled, data points with a similar number of input columns (e.g. sequence lengths) are grouped into the same samples
+	// After shuffling, each window of `bucketWindow` samples (`sampleSize * bucketWindow` data points) is sorted by length, so the
+	// samples cut from it hold data points of similar lengths and every sample does a similar amount of work
+	bool bucketByLength = false;
+	int bucketWindow = 50;
+	// Samples are propagated one at a time by default
+	// When enabled, each sample is propagated at once as a matrix with a column per data point (Required for BatchNormLayer batch statistics)
+	bool packSamples = false;
+	// Seed of the shuffling (0 picks a time based seed)
+	unsigned int shuffleSeed = 0;
+	// Optional data-parallel training across processes (Set up by NNProcessGroup::attach() from distributed.hpp)
+	// Each of the `worldSize` processes propagates its `rank`th share of every sample, then allReduce(nn, local, total)
+	// replaces the averaged gradients of its `local` data points with the average over all `total` data points of the sample
+	// Every process shuffles with the same seed and applies the same update, so the replicas stay identical (allReduce also
+	// averages the running statistics of BatchNormLayers)
+	int rank = 0, worldSize = 1;
+	std::function<void(NeuralNetwork&, int, int)> allReduce;
+	// Optional sharded optimizer state (Set up by NNProcessGroup::attach() with `shardOptimizerState`)
+	// Each process keeps the momentum and adam moments of only its `rank`th share of the rows of every parameter (see shardBegin())
+	// and updates only those rows, then gatherParams(nn) copies the rows updated by every process into all of them
+	// While training, the moments of the network only hold the rows of this process (NNProcessGroup::gatherOptimizerState() completes them)
+	std::function<void(NeuralNetwork&)> gatherParams;
+
+	// First row of the `rank`th of `worldSize` contiguous shares of `rows` rows
+	static int shardBegin(int rows, int rank, int worldSize) { return static_cast<long long>(rows) * rank / worldSize; }
 
 	// Train the network
+	// The batch is never modified: shuffling and bucketing reorder a permutation of its indices
 	void train(NNOptimizerType optimizer, int epochs) {
-		std::mt19937 gen(static_cast<unsigned int>(std::chrono::high_resolution_clock::now().time_since_epoch().count()));
+		if (worldSize > 1 && !allReduce) throw std::runtime_error("Distributed training needs an all-reduce function");
+		if (gatherParams) shardStates();
+		else if (statesSharded()) throw std::runtime_error("The optimizer state is sharded (Gather it before training without sharding)");
+		std::mt19937 gen(shuffleSeed != 0 ? shuffleSeed : static_cast<unsigned int>(std::chrono::high_resolution_clock::now().time_since_epoch().count()));
 		int actualSize = (sampleSize == -1) ? batch.size() : sampleSize;
+		std::vector<int> order(batch.size());
+		for (int i = 0; i < order.size(); i++) order[i] = i;
 
 		for (int epoch = 1; epoch <= epochs; epoch++) {
-			if (enableShuffling) std::shuffle(batch.begin(), batch.end(), gen);
+			if (enableShuffling) std::shuffle(order.begin(), order.end(), gen);
+			if (bucketByLength) {
+				int window = actualSize * bucketWindow;
+				for (int i = 0; i < order.size(); i += window) {
+					std::stable_sort(
+						order.begin() + i,
+						order.begin() + std::min(i + window, static_cast<int>(order.size())),
+						[this](int a, int b) { return batch[a].first.cols() < batch[b].first.cols(); }
+					);
+				}
+			}
 			for (int i = 0; i < batch.size(); i += actualSize) {
-				std::vector<std::pair<NNMatrix, NNMatrix>> sample(
-					batch.begin() + i,
-					batch.begin() + std::min(i + actualSize, static_cast<int>(batch.size()))
-				);
-				nn.averagePDs(sample);
+				// The sample is a view of the batch through the permutation, so no data points are copied or moved
+				// In distributed training, the view only covers the share of this process
+				int end = std::min(i + actualSize, static_cast<int>(batch.size()));
+				NNBatchView sample(batch, i + (end - i) * rank / worldSize, i + (end - i) * (rank + 1) / worldSize, order.data());
+				sample.offset = sample.begin - i; // Stochastic layers seek to the position in the whole sample
+				if (sample.size() == 0) nn.clearAvgGrads();
+				else if (packSamples) nn.averagePackedPDs(sample);
+				else nn.averagePDs(sample);
+				if (worldSize > 1) allReduce(nn, sample.size(), end - i);
 				switch (optimizer) {
 					case NNOptimizerType::GradientDescent: gradientDescent(); break;
 					case NNOptimizerType::Momentum: momentum(); break;
 					case NNOptimizerType::Adam: adam(); break;
 					default: throw std::runtime_error("Unknown optimizer value");
 				}
+				if (gatherParams) gatherParams(nn);
+				nn.applyMasks();
 				nn.iterationsTrained++;
 				iterationCallback();
 			}
@@ -56,6 +103,8 @@ public:
 		}
 	}
 	// Note: all these functions assume that the average partial derivatives are already set and iteration, epoch and callback are handled in train function
+	// Layers with sparse gradients only have the rows in their gradients updated (Momentum and moments of other rows are not decayed)
+	// With a sharded optimizer state, only the rows of this process are updated (Row r is row k of the moments)
 	// Train the network using gradient descent (Requires learningRate)
 	inline void gradientDescent() {
 		// θ = θ - α * ∂L/∂θ
@@ -63,7 +112,9 @@ public:
 			for (int j = 0; j < nn.layers[i]->params.size(); j++) {
 				NNMatrix& param = nn.layers[i]->params[j];
 				NNMatrix& avgGrad = nn.avgGrads[i][j];
-				param = param - learningRate * avgGrad;
+				updateRows(i, j, [&](int r, int) {
+					for (int c = 0; c < param.cols(); c++) param[r][c] -= learningRate * avgGrad[r][c];
+				});
 			}
 		}
 	}
@@ -76,8 +127,12 @@ public:
 				NNMatrix& param = nn.layers[i]->params[j];
 				NNMatrix& avgGrad = nn.avgGrads[i][j];
 				NNMatrix& v = nn.momentumV[i][j];
-				v = beta * v + (1 - beta) * avgGrad;
-				param = param - learningRate * v;
+				updateRows(i, j, [&](int r, int k) {
+					for (int c = 0; c < param.cols(); c++) {
+						v[k][c] = beta * v[k][c] + (1 - beta) * avgGrad[r][c];
+						param[r][c] -= learningRate * v[k][c];
+					}
+				});
 			}
 		}
 	}
@@ -97,11 +152,65 @@ public:
 				NNMatrix& avgGrad = nn.avgGrads[i][j];
 				NNMatrix& m = nn.adamM[i][j];
 				NNMatrix& v = nn.adamV[i][j];
-				m = beta1 * m + (1 - beta1) * avgGrad;
-				v = beta2 * v + (1 - beta2) * (avgGrad ^ 2);
-				param = param - learningRate * (m/c1) / (((v/c2) ^ 0.5) + epsilon);
+				updateRows(i, j, [&](int r, int k) {
+					for (int c = 0; c < param.cols(); c++) {
+						double g = avgGrad[r][c];
+						m[k][c] = beta1 * m[k][c] + (1 - beta1) * g;
+						v[k][c] = beta2 * v[k][c] + (1 - beta2) * g * g;
+						param[r][c] -= learningRate * (m[k][c] / c1) / (std::sqrt(v[k][c] / c2) + epsilon);
+					}
+				});
+			}
+		}
+	}
+private:
+	// Run update(r, k) for every row r of parameter j of layer i that has a gradient, where k is the row of its optimizer state
+	// Sparse layers only update the rows in their gradients and sharded DenseLayers update each row on the thread owning it
+	// With a sharded optimizer state, only the rows of this process are updated
+	template<typename F>
+	void updateRows(int i, int j, F update) {
+		Layer& layer = *nn.layers[i];
+		int rows = layer.params[j].get().rows();
+		int first = gatherParams ? shardBegin(rows, rank, worldSize) : 0, last = gatherParams ? shardBegin(rows, rank + 1, worldSize) : rows;
+		if (layer.sparseGrads) {
+			for (int r : nn.avgRows[i][j]) {
+				if (r >= first && r < last) update(r, r - first);
+			}
+			return;
+		}
+		DenseLayer* dense = dynamic_cast<DenseLayer*>(&layer);
+		if (dense != nullptr && dense->shards > 1) {
+			dense->forEachShard([&update, first, last](int, int begin, int end) {
+				for (int r = std::max(begin, first); r < std::min(end, last); r++) update(r, r - first);
+			});
+			return;
+		}
+		for (int r = first; r < last; r++) update(r, r - first);
+	}
+	// Keep only the rows of this process in the complete optimizer moments (e.g. after loading or gathering them)
+	void shardStates() {
+		for (std::vector<std::vector<NNMatrix>>* moment : { &nn.momentumV, &nn.adamM, &nn.adamV }) {
+			for (int i = 0; i < nn.depth; i++) {
+				for (int j = 0; j < nn.layers[i]->params.size(); j++) {
+					NNMatrix& state = (*moment)[i][j];
+					int rows = nn.layers[i]->params[j].get().rows();
+					if (state.rows() != rows) continue; // Already sharded
+					int first = shardBegin(rows, rank, worldSize), last = shardBegin(rows, rank + 1, worldSize);
+					state.data = std::vector<std::vector<double>>(state.data.begin() + first, state.data.begin() + last);
+				}
+			}
+		}
+	}
+	// Whether the optimizer moments only hold some of the rows of the parameters
+	bool statesSharded() {
+		for (std::vector<std::vector<NNMatrix>>* moment : { &nn.momentumV, &nn.adamM, &nn.adamV }) {
+			for (int i = 0; i < nn.depth; i++) {
+				for (int j = 0; j < nn.layers[i]->params.size(); j++) {
+					if ((*moment)[i][j].rows() != nn.layers[i]->params[j].get().rows()) return true;
+				}
 			}
 		}
+		return false;
 	}
 };
 